@@ -136,6 +136,32 @@ wfastcall void WIN_FUNC(KfReleaseSpinLock,2)
 	nt_spin_unlock_irql(lock, oldirql);
 }
 
+wfastcall void WIN_FUNC(KeAcquireInStackQueuedSpinLock,2)
+	(NT_SPIN_LOCK *lock, struct klock_queue_handle *handle)
+{
+	handle->old_irql = raise_irql(DISPATCH_LEVEL);
+	nt_spin_lock_queued(lock, &handle->lock_queue);
+}
+
+wfastcall void WIN_FUNC(KeReleaseInStackQueuedSpinLock,1)
+	(struct klock_queue_handle *handle)
+{
+	nt_spin_unlock_queued(handle->lock_queue.lock, &handle->lock_queue);
+	lower_irql(handle->old_irql);
+}
+
+wfastcall void WIN_FUNC(KeAcquireInStackQueuedSpinLockAtDpcLevel,2)
+	(NT_SPIN_LOCK *lock, struct klock_queue_handle *handle)
+{
+	nt_spin_lock_queued(lock, &handle->lock_queue);
+}
+
+wfastcall void WIN_FUNC(KeReleaseInStackQueuedSpinLockFromDpcLevel,1)
+	(struct klock_queue_handle *handle)
+{
+	nt_spin_unlock_queued(handle->lock_queue.lock, &handle->lock_queue);
+}
+
 wfastcall void WIN_FUNC(KefAcquireSpinLockAtDpcLevel,1)
 	(NT_SPIN_LOCK *lock)
 {
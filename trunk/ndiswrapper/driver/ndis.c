@@ -24,6 +24,7 @@
 
 #define MAX_ALLOCATED_NDIS_PACKETS TX_RING_SIZE
 #define MAX_ALLOCATED_NDIS_BUFFERS TX_RING_SIZE
+#define MAX_PREALLOCATED_NDIS_BUFFERS 256
 
 #if LINUX_VERSION_CODE >= KERNEL_VERSION(4, 0, 0)
 #define strnicmp strncasecmp
@@ -35,6 +36,10 @@ static spinlock_t ndis_work_list_lock;
 
 struct workqueue_struct *ndis_wq;
 
+/* buffer pools are kept in a list only for procfs statistics */
+struct nt_list ndis_buffer_pool_list;
+spinlock_t ndis_buffer_pool_list_lock;
+
 static void *ndis_get_routine_address(char *name);
 
 wstdcall void WIN_FUNC(NdisInitializeWrapper,4)
@@ -896,40 +901,107 @@ wstdcall void WIN_FUNC(NdisInitializeReadWriteLock,1)
 	return;
 }
 
-/* read/write locks are implemented in a rather simplistic way - we
- * should probably use Linux's rw_lock implementation */
+/* read/write locks follow Windows' layout: each processor has its
+ * own reader count in ref_count, so readers only touch their own slot;
+ * writers serialize on klock and then wait for all reader counts to
+ * drain. A reader that finds klock held backs off until the writer is
+ * done, so writers can't be starved by a stream of readers. A reader
+ * whose slot is already in use is nested inside another read on this
+ * processor and must not back off, or it would deadlock against a
+ * waiting writer. With more than MAXIMUM_PROCESSORS processors,
+ * some processors share a slot, so a count can't tell a nested read
+ * from another processor's read; readers on such processors instead
+ * take klock, as writers do, and record themselves in context so
+ * nested reads on that processor don't deadlock on it. */
+
+static BOOLEAN rw_lock_slot_shared(unsigned int cpu)
+{
+	return cpu >= MAXIMUM_PROCESSORS ||
+		cpu + MAXIMUM_PROCESSORS < nr_cpu_ids;
+}
 
 wstdcall void WIN_FUNC(NdisAcquireReadWriteLock,3)
 	(struct ndis_rw_lock *rw_lock, BOOLEAN write,
 	 struct lock_state *lock_state)
 {
+	union ndis_rw_lock_refcount *ref;
+	unsigned int cpu, slot;
+	int i;
+
 	if (write) {
-		while (1) {
-			if (cmpxchg(&rw_lock->count, 0, -1) == 0)
-				return;
-			while (rw_lock->count)
+		lock_state->irql = nt_spin_lock_irql(&rw_lock->klock,
+						     DISPATCH_LEVEL);
+		lock_state->state = RW_LOCK_STATE_WRITE;
+		smp_mb();
+		for (i = 0; i < MAXIMUM_PROCESSORS; i++) {
+			while (rw_lock->ref_count[i].count)
 				cpu_relax();
 		}
 		return;
 	}
+	lock_state->irql = raise_irql(DISPATCH_LEVEL);
+	/* at DISPATCH_LEVEL current task is bound to this processor
+	 * and no other task can take the lock on it, so a count that
+	 * is already positive means this processor holds the lock
+	 * (nested read) and a writer can't get in until it is
+	 * released; similarly, context can only be set to this
+	 * processor by this processor */
+	cpu = raw_smp_processor_id();
+	if (rw_lock_slot_shared(cpu)) {
+		if (ACCESS_ONCE(rw_lock->context) == (void *)(cpu + 1UL)) {
+			lock_state->state = RW_LOCK_STATE_EXCL |
+				(1 << RW_LOCK_STATE_SLOT_SHIFT);
+			return;
+		}
+		nt_spin_lock(&rw_lock->klock);
+		rw_lock->context = (void *)(cpu + 1UL);
+		lock_state->state = RW_LOCK_STATE_EXCL;
+		return;
+	}
+	slot = cpu;
+	lock_state->state = RW_LOCK_STATE_READ |
+		(slot << RW_LOCK_STATE_SLOT_SHIFT);
+	ref = &rw_lock->ref_count[slot];
 	while (1) {
-		typeof(rw_lock->count) count;
-		while ((count = rw_lock->count) < 0)
-			cpu_relax();
-		if (cmpxchg(&rw_lock->count, count, count + 1) == count)
+		if (post_atomic_add(ref->count, 1) > 1)
+			return;
+		smp_mb();
+		if (likely(!ACCESS_ONCE(rw_lock->klock)))
 			return;
+		/* writer is active or waiting */
+		atomic_dec_var(ref->count);
+		while (ACCESS_ONCE(rw_lock->klock))
+			cpu_relax();
 	}
 }
 
 wstdcall void WIN_FUNC(NdisReleaseReadWriteLock,2)
 	(struct ndis_rw_lock *rw_lock, struct lock_state *lock_state)
 {
-	if (rw_lock->count > 0)
-		pre_atomic_add(rw_lock->count, -1);
-	else if (rw_lock->count == -1)
-		rw_lock->count = 0;
-	else
-		WARNING("invalid state: %d", rw_lock->count);
+	unsigned int slot;
+
+	switch (lock_state->state & RW_LOCK_STATE_MODE_MASK) {
+	case RW_LOCK_STATE_READ:
+		slot = lock_state->state >> RW_LOCK_STATE_SLOT_SHIFT;
+		smp_mb();
+		atomic_dec_var(rw_lock->ref_count[slot].count);
+		lower_irql(lock_state->irql);
+		break;
+	case RW_LOCK_STATE_WRITE:
+		nt_spin_unlock_irql(&rw_lock->klock, lock_state->irql);
+		break;
+	case RW_LOCK_STATE_EXCL:
+		/* nested read doesn't own klock */
+		if (!(lock_state->state >> RW_LOCK_STATE_SLOT_SHIFT)) {
+			rw_lock->context = NULL;
+			nt_spin_unlock(&rw_lock->klock);
+		}
+		lower_irql(lock_state->irql);
+		break;
+	default:
+		WARNING("invalid state: %d", lock_state->state);
+		break;
+	}
 }
 
 wstdcall NDIS_STATUS WIN_FUNC(NdisMAllocateMapRegisters,5)
@@ -1176,27 +1248,69 @@ wstdcall NDIS_STATUS WIN_FUNC(NdisMAllocateSharedMemoryAsync,4)
  * it should indicate maximum number of MDLs used with num_descr and
  * pass the same pool_handle in other buffer functions, this should
  * work. Sadly, though, NdisFreeBuffer doesn't pass the pool_handle,
- * so we use 'process' field of MDL to store pool_handle. */
+ * so we use 'process' field of MDL to store pool_handle.
+ *
+ * The free list is an slist, so MDLs are allocated and freed without
+ * locks (with cmpxchg8b/cmpxchg16b). Only MDLs from mdl_cache (which
+ * can map up to MDL_CACHE_PAGES pages) are kept in the free list, and
+ * the pool is populated with up to num_descr such MDLs when it is
+ * created. */
+
+static inline void buffer_pool_push(struct ndis_buffer_pool *pool,
+				    ndis_buffer *buffer)
+{
+	PushEntrySList(&pool->free_list, (struct nt_slist *)buffer,
+		       &pool->free_list_lock);
+}
+
+static inline ndis_buffer *buffer_pool_pop(struct ndis_buffer_pool *pool)
+{
+	return (ndis_buffer *)PopEntrySList(&pool->free_list,
+					    &pool->free_list_lock);
+}
+
+static void buffer_pool_free_mdl(struct ndis_buffer_pool *pool,
+				 ndis_buffer *buffer)
+{
+	/* NB NB NB: set mdl's 'pool' field to NULL before calling
+	 * free_mdl; otherwise free_mdl calls NdisFreeBuffer back */
+	atomic_dec_var(pool->num_allocated_descr);
+	buffer->pool = NULL;
+	free_mdl(buffer);
+}
 
 wstdcall void WIN_FUNC(NdisAllocateBufferPool,3)
 	(NDIS_STATUS *status, struct ndis_buffer_pool **pool_handle,
 	 UINT num_descr)
 {
 	struct ndis_buffer_pool *pool;
+	ndis_buffer *descr;
+	UINT i;
 
 	ENTER1("buffers: %d", num_descr);
-	pool = kmalloc(sizeof(*pool), irql_gfp());
+	pool = kzalloc(sizeof(*pool), irql_gfp());
 	if (!pool) {
 		*status = NDIS_STATUS_RESOURCES;
 		EXIT3(return);
 	}
 	spin_lock_init(&pool->lock);
+	nt_spin_lock_init(&pool->free_list_lock);
 	pool->max_descr = num_descr;
-	pool->num_allocated_descr = 0;
-	pool->free_descr = NULL;
+	for (i = 0; i < min(num_descr, (UINT)MAX_PREALLOCATED_NDIS_BUFFERS);
+	     i++) {
+		descr = allocate_init_mdl(NULL, 0);
+		if (!descr)
+			break;
+		pool->num_allocated_descr++;
+		buffer_pool_push(pool, descr);
+	}
+	spin_lock_bh(&ndis_buffer_pool_list_lock);
+	InsertTailList(&ndis_buffer_pool_list, &pool->list);
+	spin_unlock_bh(&ndis_buffer_pool_list_lock);
 	*pool_handle = pool;
 	*status = NDIS_STATUS_SUCCESS;
-	TRACE1("pool: %p, num_descr: %d", pool, num_descr);
+	TRACE1("pool: %p, num_descr: %d, preallocated: %d",
+	       pool, num_descr, pool->num_allocated_descr);
 	EXIT1(return);
 }
 
@@ -1215,17 +1329,15 @@ wstdcall void WIN_FUNC(NdisAllocateBuffer,5)
 		*buffer = NULL;
 		EXIT4(return);
 	}
-	spin_lock_bh(&pool->lock);
-	if ((descr = pool->free_descr))
-		pool->free_descr = descr->next;
-	spin_unlock_bh(&pool->lock);
+	if (likely(SPAN_PAGES(virt, length) <= MDL_CACHE_PAGES))
+		descr = buffer_pool_pop(pool);
+	else
+		descr = NULL;
 	if (descr) {
-		typeof(descr->flags) flags;
-		flags = descr->flags;
 		memset(descr, 0, sizeof(*descr));
 		MmInitializeMdl(descr, virt, length);
-		if (flags & MDL_CACHE_ALLOCATED)
-			descr->flags |= MDL_CACHE_ALLOCATED;
+		descr->flags |= MDL_ALLOCATED_FIXED_SIZE | MDL_CACHE_ALLOCATED;
+		atomic_inc_var(pool->hits);
 	} else {
 		if (pool->num_allocated_descr > pool->max_descr) {
 			TRACE2("pool %p is full: %d(%d)", pool,
@@ -1245,8 +1357,8 @@ wstdcall void WIN_FUNC(NdisAllocateBuffer,5)
 		}
 		TRACE4("buffer %p for %p, %d", descr, virt, length);
 		atomic_inc_var(pool->num_allocated_descr);
+		atomic_inc_var(pool->misses);
 	}
-	/* TODO: make sure this mdl can map given buffer */
 	MmBuildMdlForNonPagedPool(descr);
 //	descr->flags |= MDL_ALLOCATED_FIXED_SIZE |
 //		MDL_MAPPED_TO_SYSTEM_VA | MDL_PAGES_LOCKED;
@@ -1268,41 +1380,36 @@ wstdcall void WIN_FUNC(NdisFreeBuffer,1)
 		EXIT4(return);
 	}
 	pool = buffer->pool;
-	if (pool->num_allocated_descr > MAX_ALLOCATED_NDIS_BUFFERS) {
-		/* NB NB NB: set mdl's 'pool' field to NULL before
-		 * calling free_mdl; otherwise free_mdl calls
-		 * NdisFreeBuffer back */
-		atomic_dec_var(pool->num_allocated_descr);
-		buffer->pool = NULL;
-		free_mdl(buffer);
-	} else {
-		spin_lock_bh(&pool->lock);
-		buffer->next = pool->free_descr;
-		pool->free_descr = buffer;
-		spin_unlock_bh(&pool->lock);
-	}
+	/* MDLs allocated with kmalloc may not be big enough for
+	 * other buffers, so they are not reused */
+	if (!(buffer->flags & MDL_CACHE_ALLOCATED) ||
+	    pool->num_allocated_descr > max(pool->max_descr,
+					    (UINT)MAX_ALLOCATED_NDIS_BUFFERS)) {
+		atomic_inc_var(pool->trimmed);
+		buffer_pool_free_mdl(pool, buffer);
+	} else
+		buffer_pool_push(pool, buffer);
 	EXIT4(return);
 }
 
 wstdcall void WIN_FUNC(NdisFreeBufferPool,1)
 	(struct ndis_buffer_pool *pool)
 {
-	ndis_buffer *cur, *next;
+	ndis_buffer *cur;
 
 	TRACE3("pool: %p", pool);
 	if (!pool) {
 		WARNING("invalid pool");
 		EXIT3(return);
 	}
-	spin_lock_bh(&pool->lock);
-	cur = pool->free_descr;
-	while (cur) {
-		next = cur->next;
-		cur->pool = NULL;
-		free_mdl(cur);
-		cur = next;
-	}
-	spin_unlock_bh(&pool->lock);
+	spin_lock_bh(&ndis_buffer_pool_list_lock);
+	RemoveEntryList(&pool->list);
+	spin_unlock_bh(&ndis_buffer_pool_list_lock);
+	while ((cur = buffer_pool_pop(pool)))
+		buffer_pool_free_mdl(pool, cur);
+	if (pool->num_allocated_descr)
+		TRACE1("%d buffers in pool %p are still in use",
+			pool->num_allocated_descr, pool);
 	kfree(pool);
 	pool = NULL;
 	EXIT3(return);
@@ -1464,9 +1571,15 @@ wstdcall void WIN_FUNC(NdisAllocatePacketPoolEx,5)
 	pool->num_used_descr = 0;
 	pool->free_descr = NULL;
 	pool->proto_rsvd_length = proto_rsvd_length;
+	/* alloc_percpu may sleep; if called at DISPATCH_LEVEL, all
+	 * packets go through depot */
+	if (in_atomic())
+		pool->magazines = NULL;
+	else
+		pool->magazines = alloc_percpu(struct ndis_packet_magazine);
 	*pool_handle = pool;
 	*status = NDIS_STATUS_SUCCESS;
-	TRACE3("pool: %p", pool);
+	TRACE3("pool: %p, %p", pool, pool->magazines);
 	EXIT3(return);
 }
 
@@ -1489,6 +1602,18 @@ wstdcall void WIN_FUNC(NdisFreePacketPool,1)
 		WARNING("invalid pool");
 		EXIT3(return);
 	}
+	if (pool->magazines) {
+		struct ndis_packet_magazine *mag;
+		int cpu;
+
+		for_each_possible_cpu(cpu) {
+			mag = per_cpu_ptr(pool->magazines, cpu);
+			while (mag->count > 0)
+				kfree(mag->packets[--mag->count]);
+		}
+		free_percpu(pool->magazines);
+		pool->magazines = NULL;
+	}
 	spin_lock_bh(&pool->lock);
 	packet = pool->free_descr;
 	while (packet) {
@@ -1507,7 +1632,59 @@ wstdcall void WIN_FUNC(NdisFreePacketPool,1)
 wstdcall UINT WIN_FUNC(NdisPacketPoolUsage,1)
 	(struct ndis_packet_pool *pool)
 {
-	EXIT4(return pool->num_used_descr);
+	int cpu, used;
+
+	used = pool->num_used_descr;
+	if (pool->magazines) {
+		for_each_possible_cpu(cpu)
+			used += per_cpu_ptr(pool->magazines, cpu)->used;
+	}
+	if (used < 0)
+		used = 0;
+	EXIT4(return used);
+}
+
+/* get a free packet from magazine of this cpu, refilling it from
+ * depot if empty; called with bottom halves disabled */
+static struct ndis_packet *
+packet_magazine_get(struct ndis_packet_pool *pool,
+		    struct ndis_packet_magazine *mag)
+{
+	struct ndis_packet *packet;
+
+	if (mag->count == 0) {
+		spin_lock(&pool->lock);
+		while (mag->count < NDIS_PACKET_MAGAZINE_SIZE / 2 &&
+		       (packet = pool->free_descr)) {
+			pool->free_descr = (void *)packet->reserved[0];
+			mag->packets[mag->count++] = packet;
+		}
+		spin_unlock(&pool->lock);
+		if (mag->count == 0)
+			return NULL;
+	}
+	return mag->packets[--mag->count];
+}
+
+/* put packet in magazine of this cpu, moving half of it to depot if
+ * full; called with bottom halves disabled */
+static void packet_magazine_put(struct ndis_packet_pool *pool,
+				struct ndis_packet_magazine *mag,
+				struct ndis_packet *packet)
+{
+	struct ndis_packet *cur;
+
+	if (mag->count == NDIS_PACKET_MAGAZINE_SIZE) {
+		spin_lock(&pool->lock);
+		while (mag->count > NDIS_PACKET_MAGAZINE_SIZE / 2) {
+			cur = mag->packets[--mag->count];
+			cur->reserved[0] =
+				(typeof(cur->reserved[0]))pool->free_descr;
+			pool->free_descr = cur;
+		}
+		spin_unlock(&pool->lock);
+	}
+	mag->packets[mag->count++] = packet;
 }
 
 wstdcall void WIN_FUNC(NdisAllocatePacket,3)
@@ -1515,6 +1692,7 @@ wstdcall void WIN_FUNC(NdisAllocatePacket,3)
 	 struct ndis_packet_pool *pool)
 {
 	struct ndis_packet *packet;
+	struct ndis_packet_magazine *mag;
 	int packet_length;
 
 	ENTER4("pool: %p", pool);
@@ -1524,23 +1702,37 @@ wstdcall void WIN_FUNC(NdisAllocatePacket,3)
 		EXIT4(return);
 	}
 	assert_irql(_irql_ <= SOFT_LEVEL);
-	if (pool->num_used_descr > pool->max_descr) {
-		TRACE3("pool %p is full: %d(%d)", pool,
-		       pool->num_used_descr, pool->max_descr);
-#ifndef ALLOW_POOL_OVERFLOW
-		*status = NDIS_STATUS_RESOURCES;
-		*ndis_packet = NULL;
-		return;
-#endif
-	}
 	/* packet has space for 1 byte in protocol_reserved field */
 	packet_length = sizeof(*packet) - 1 + pool->proto_rsvd_length +
 		sizeof(struct ndis_packet_oob_data);
-	spin_lock_bh(&pool->lock);
-	if ((packet = pool->free_descr))
-		pool->free_descr = (void *)packet->reserved[0];
-	spin_unlock_bh(&pool->lock);
+	if (pool->magazines) {
+		local_bh_disable();
+		mag = per_cpu_ptr(pool->magazines, smp_processor_id());
+		packet = packet_magazine_get(pool, mag);
+		if (packet)
+			mag->used++;
+		local_bh_enable();
+	} else {
+		spin_lock_bh(&pool->lock);
+		if ((packet = pool->free_descr))
+			pool->free_descr = (void *)packet->reserved[0];
+		spin_unlock_bh(&pool->lock);
+		if (packet)
+			atomic_inc_var(pool->num_used_descr);
+	}
 	if (!packet) {
+		/* number of packets in use is checked only when a new
+		 * packet is needed, as cached packets exist only if
+		 * limit was not reached when they were allocated */
+		if (NdisPacketPoolUsage(pool) > pool->max_descr) {
+			TRACE3("pool %p is full: %d(%d)", pool,
+			       NdisPacketPoolUsage(pool), pool->max_descr);
+#ifndef ALLOW_POOL_OVERFLOW
+			*status = NDIS_STATUS_RESOURCES;
+			*ndis_packet = NULL;
+			return;
+#endif
+		}
 		packet = kmalloc(packet_length, irql_gfp());
 		if (!packet) {
 			WARNING("couldn't allocate packet");
@@ -1549,12 +1741,23 @@ wstdcall void WIN_FUNC(NdisAllocatePacket,3)
 			return;
 		}
 		atomic_inc_var(pool->num_allocated_descr);
+		if (pool->magazines) {
+			local_bh_disable();
+			per_cpu_ptr(pool->magazines, smp_processor_id())->used++;
+			local_bh_enable();
+		} else
+			atomic_inc_var(pool->num_used_descr);
 	}
 	TRACE4("%p, %p", pool, packet);
-	atomic_inc_var(pool->num_used_descr);
-	memset(packet, 0, packet_length);
+	/* miniport and protocol reserved areas are owned by their
+	 * users, so only NDIS's fields are initialized */
+	memset(&packet->private, 0, sizeof(packet->private));
+	packet->reserved[0] = 0;
+	packet->reserved[1] = 0;
 	packet->private.oob_offset =
 		packet_length - sizeof(struct ndis_packet_oob_data);
+	memset(NDIS_PACKET_OOB_DATA(packet), 0,
+	       sizeof(struct ndis_packet_oob_data));
 	packet->private.packet_flags = fPACKET_ALLOCATED_BY_NDIS;
 	packet->private.pool = pool;
 	*ndis_packet = packet;
@@ -1573,6 +1776,7 @@ wstdcall void WIN_FUNC(NdisFreePacket,1)
 	(struct ndis_packet *packet)
 {
 	struct ndis_packet_pool *pool;
+	struct ndis_packet_magazine *mag;
 
 	ENTER4("%p, %p", packet, packet->private.pool);
 	pool = packet->private.pool;
@@ -1580,8 +1784,6 @@ wstdcall void WIN_FUNC(NdisFreePacket,1)
 		ERROR("invalid pool %p", packet);
 		EXIT4(return);
 	}
-	assert((int)pool->num_used_descr > 0);
-	atomic_dec_var(pool->num_used_descr);
 	if (packet->reserved[1]) {
 		TRACE3("%p, %p", packet, (void *)packet->reserved[1]);
 		kfree((void *)packet->reserved[1]);
@@ -1591,13 +1793,26 @@ wstdcall void WIN_FUNC(NdisFreePacket,1)
 		TRACE3("%p", pool);
 		atomic_dec_var(pool->num_allocated_descr);
 		kfree(packet);
+		packet = NULL;
+	}
+	if (pool->magazines) {
+		local_bh_disable();
+		mag = per_cpu_ptr(pool->magazines, smp_processor_id());
+		mag->used--;
+		if (packet)
+			packet_magazine_put(pool, mag, packet);
+		local_bh_enable();
 	} else {
-		TRACE4("%p, %p, %p", pool, packet, pool->free_descr);
-		spin_lock_bh(&pool->lock);
-		packet->reserved[0] =
-			(typeof(packet->reserved[0]))pool->free_descr;
-		pool->free_descr = packet;
-		spin_unlock_bh(&pool->lock);
+		assert((int)pool->num_used_descr > 0);
+		atomic_dec_var(pool->num_used_descr);
+		if (packet) {
+			TRACE4("%p, %p, %p", pool, packet, pool->free_descr);
+			spin_lock_bh(&pool->lock);
+			packet->reserved[0] =
+				(typeof(packet->reserved[0]))pool->free_descr;
+			pool->free_descr = packet;
+			spin_unlock_bh(&pool->lock);
+		}
 	}
 	EXIT4(return);
 }
@@ -1805,11 +2020,11 @@ wstdcall void WIN_FUNC(NdisMInitializeTimer,4)
 wstdcall void WIN_FUNC(NdisMSetPeriodicTimer,2)
 	(struct ndis_mp_timer *timer, UINT period_ms)
 {
-	unsigned long expires = MSEC_TO_HZ(period_ms);
+	u64 period = (u64)period_ms * TICKSPERMSEC;
 
-	TIMERENTER("%p, %u, %ld", timer, period_ms, expires);
+	TIMERENTER("%p, %u", timer, period_ms);
 	assert_irql(_irql_ <= DISPATCH_LEVEL);
-	wrap_set_timer(&timer->nt_timer, expires, expires, &timer->kdpc);
+	wrap_set_timer(&timer->nt_timer, period, period, &timer->kdpc);
 	TIMEREXIT(return);
 }
 
@@ -1839,12 +2054,11 @@ wstdcall void WIN_FUNC(NdisInitializeTimer,3)
 wstdcall void WIN_FUNC(NdisSetTimer,2)
 	(struct ndis_timer *timer, UINT duetime_ms)
 {
-	unsigned long expires = MSEC_TO_HZ(duetime_ms);
-
-	TIMERENTER("%p, %p, %u, %ld", timer, timer->nt_timer.wrap_timer,
-		   duetime_ms, expires);
+	TIMERENTER("%p, %p, %u", timer, timer->nt_timer.wrap_timer,
+		   duetime_ms);
 	assert_irql(_irql_ <= DISPATCH_LEVEL);
-	wrap_set_timer(&timer->nt_timer, expires, 0, &timer->kdpc);
+	wrap_set_timer(&timer->nt_timer, (u64)duetime_ms * TICKSPERMSEC, 0,
+		       &timer->kdpc);
 	TIMEREXIT(return);
 }
 
@@ -2220,24 +2434,135 @@ wstdcall void NdisMSendResourcesAvailable(struct ndis_mp_block *nmb)
 	EXIT3(return);
 }
 
-wstdcall void return_packet(void *arg1, void *arg2)
+/* allocate skb for received packet of 'length' bytes; IP header is
+ * aligned and, on newer kernels, skb head is a page fragment, so GRO
+ * and TCP can merge it with other packets without copying it again */
+static struct sk_buff *alloc_rx_skb(struct ndis_device *wnd,
+				    unsigned int length)
+{
+#if LINUX_VERSION_CODE >= KERNEL_VERSION(2,6,33)
+	return netdev_alloc_skb_ip_align(wnd->net_dev, length);
+#else
+	return dev_alloc_skb(length);
+#endif
+}
+
+/* append data in MDL chain starting at 'buffer' to skb */
+static void memcpy_skb_mdl(struct sk_buff *skb, ndis_buffer *buffer)
+{
+	while (buffer) {
+		memcpy_skb(skb, MmGetSystemAddressForMdl(buffer),
+			   MmGetMdlByteCount(buffer));
+		buffer = buffer->next;
+	}
+}
+
+/* pass received packets in 'list' to network stack; with NAPI they
+ * are queued for ndis_rx_poll, so that the stack is entered only
+ * once for all the packets indicated in a DPC */
+static void indicate_rx_skbs(struct ndis_device *wnd,
+			     struct sk_buff_head *list)
+{
+#ifdef WRAP_NAPI
+	unsigned long flags;
+	unsigned int n;
+
+	if (skb_queue_empty(list))
+		return;
+	/* NAPI is disabled while interface is down; packets queued
+	 * now would be delivered stale when it is opened again */
+	if (unlikely(!netif_running(wnd->net_dev))) {
+		pre_atomic_add(wnd->net_stats.rx_dropped, list->qlen);
+		__skb_queue_purge(list);
+		return;
+	}
+	spin_lock_irqsave(&wnd->rx_queue.lock, flags);
+	if (wnd->rx_queue.qlen + list->qlen <= MAX_RX_QUEUE_LEN) {
+		skb_queue_splice_tail_init(list, &wnd->rx_queue);
+		n = 0;
+	} else
+		n = list->qlen;
+	spin_unlock_irqrestore(&wnd->rx_queue.lock, flags);
+	if (n) {
+		TRACE2("rx queue full; %u packets dropped", n);
+		pre_atomic_add(wnd->net_stats.rx_dropped, n);
+		__skb_queue_purge(list);
+	}
+	if (in_interrupt())
+		napi_schedule(&wnd->napi);
+	else {
+		/* let the softirq run right away */
+		local_bh_disable();
+		napi_schedule(&wnd->napi);
+		local_bh_enable();
+	}
+#else
+	struct sk_buff *skb;
+
+	while ((skb = __skb_dequeue(list))) {
+		if (in_interrupt())
+			netif_rx(skb);
+		else
+			netif_rx_ni(skb);
+	}
+#endif
+}
+
+static void indicate_rx_skb(struct ndis_device *wnd, struct sk_buff *skb)
+{
+	struct sk_buff_head list;
+
+	__skb_queue_head_init(&list);
+	__skb_queue_tail(&list, skb);
+	indicate_rx_skbs(wnd, &list);
+}
+
+static void return_packets_worker(struct work_struct *work)
 {
 	struct ndis_device *wnd;
-	struct ndis_packet *packet;
+	struct ndis_packet *packet, *next, *head;
 	struct miniport *mp;
 	KIRQL irql;
 
-	wnd = arg1;
-	packet = arg2;
-	ENTER4("%p, %p", wnd, packet);
+	wnd = container_of(work, struct ndis_device, return_work);
+	packet = xchg(&wnd->return_packets, NULL);
+	if (!packet)
+		EXIT4(return);
+	/* return packets in the order they were indicated */
+	head = NULL;
+	while (packet) {
+		next = (struct ndis_packet *)packet->reserved[0];
+		packet->reserved[0] = (ULONG_PTR)head;
+		head = packet;
+		packet = next;
+	}
 	mp = &wnd->wd->driver->ndis_driver->mp;
 	irql = serialize_lock_irql(wnd);
 	assert_irql(_irql_ == DISPATCH_LEVEL);
-	LIN2WIN2(mp->return_packet, wnd->nmb->mp_ctx, packet);
+	for (packet = head; packet; packet = next) {
+		next = (struct ndis_packet *)packet->reserved[0];
+		packet->reserved[0] = 0;
+		TRACE4("%p, %p", wnd, packet);
+		LIN2WIN2(mp->return_packet, wnd->nmb->mp_ctx, packet);
+	}
 	serialize_unlock_irql(wnd, irql);
 	EXIT4(return);
 }
-WIN_FUNC_DECL(return_packet,2)
+
+/* queue packets linked from 'first' to 'last' through reserved[0] to
+ * be returned by return_packets_worker */
+static void queue_return_packets(struct ndis_device *wnd,
+				 struct ndis_packet *first,
+				 struct ndis_packet *last)
+{
+	struct ndis_packet *head;
+
+	do {
+		head = ACCESS_ONCE(wnd->return_packets);
+		last->reserved[0] = (ULONG_PTR)head;
+	} while (cmpxchg(&wnd->return_packets, head, first) != head);
+	queue_work(ntos_wq, &wnd->return_work);
+}
 
 /* called via function pointer */
 wstdcall void NdisMIndicateReceivePacket(struct ndis_mp_block *nmb,
@@ -2252,10 +2577,14 @@ wstdcall void NdisMIndicateReceivePacket(struct ndis_mp_block *nmb,
 	struct ndis_packet_oob_data *oob_data;
 	void *virt;
 	struct ndis_tcp_ip_checksum_packet_info csum;
+	struct sk_buff_head rx_list;
+	struct ndis_packet *return_first, *return_last;
 
 	ENTER3("%p, %d", nmb, nr_packets);
 	assert_irql(_irql_ <= DISPATCH_LEVEL);
 	wnd = nmb->wnd;
+	__skb_queue_head_init(&rx_list);
+	return_first = return_last = NULL;
 	for (i = 0; i < nr_packets; i++) {
 		packet = packets[i];
 		if (!packet) {
@@ -2271,13 +2600,9 @@ wstdcall void NdisMIndicateReceivePacket(struct ndis_mp_block *nmb,
 		oob_data = NDIS_PACKET_OOB_DATA(packet);
 		TRACE3("0x%x, 0x%x, %llu", packet->private.flags,
 		       packet->private.packet_flags, oob_data->time_rxed);
-		skb = dev_alloc_skb(total_length);
+		skb = alloc_rx_skb(wnd, total_length);
 		if (skb) {
-			while (buffer) {
-				memcpy_skb(skb, MmGetSystemAddressForMdl(buffer),
-					   MmGetMdlByteCount(buffer));
-				buffer = buffer->next;
-			}
+			memcpy_skb_mdl(skb, buffer);
 			skb->dev = wnd->net_dev;
 			skb->protocol = eth_type_trans(skb, wnd->net_dev);
 			pre_atomic_add(wnd->net_stats.rx_bytes, total_length);
@@ -2291,11 +2616,7 @@ wstdcall void NdisMIndicateReceivePacket(struct ndis_mp_block *nmb,
 				skb->ip_summed = CHECKSUM_UNNECESSARY;
 			else
 				skb->ip_summed = CHECKSUM_NONE;
-
-			if (in_interrupt())
-				netif_rx(skb);
-			else
-				netif_rx_ni(skb);
+			__skb_queue_tail(&rx_list, skb);
 		} else {
 			WARNING("couldn't allocate skb; packet dropped");
 			atomic_inc_var(wnd->net_stats.rx_dropped);
@@ -2320,10 +2641,16 @@ wstdcall void NdisMIndicateReceivePacket(struct ndis_mp_block *nmb,
 		 * MiniportReturnPacket later for this packet. Calling
 		 * MiniportReturnPacket from here is not correct - the
 		 * driver doesn't expect it (at least Centrino driver
-		 * crashes) */
-		schedule_ntos_work_item(WIN_FUNC_PTR(return_packet,2),
-					wnd, packet);
-	}
+		 * crashes); these packets are queued to be returned
+		 * together */
+		packet->reserved[0] = (ULONG_PTR)return_first;
+		return_first = packet;
+		if (!return_last)
+			return_last = packet;
+	}
+	indicate_rx_skbs(wnd, &rx_list);
+	if (return_first)
+		queue_return_packets(wnd, return_first, return_last);
 	EXIT3(return);
 }
 
@@ -2372,10 +2699,9 @@ wstdcall void EthRxIndicateHandler(struct ndis_mp_block *nmb, void *rx_ctx,
 		serialize_unlock_irql(wnd, irql);
 		TRACE3("%d, %d, %d", header_size, look_ahead_size, bytes_txed);
 		if (res == NDIS_STATUS_SUCCESS) {
-			ndis_buffer *buffer;
 			struct ndis_tcp_ip_checksum_packet_info csum;
-			skb = dev_alloc_skb(header_size + look_ahead_size +
-					    bytes_txed);
+			skb = alloc_rx_skb(wnd, header_size +
+					   look_ahead_size + bytes_txed);
 			if (!skb) {
 				ERROR("couldn't allocate skb; packet dropped");
 				atomic_inc_var(wnd->net_stats.rx_dropped);
@@ -2384,13 +2710,7 @@ wstdcall void EthRxIndicateHandler(struct ndis_mp_block *nmb, void *rx_ctx,
 			}
 			memcpy_skb(skb, header, header_size);
 			memcpy_skb(skb, look_ahead, look_ahead_size);
-			buffer = packet->private.buffer_head;
-			while (buffer) {
-				memcpy_skb(skb,
-					   MmGetSystemAddressForMdl(buffer),
-					   MmGetMdlByteCount(buffer));
-				buffer = buffer->next;
-			}
+			memcpy_skb_mdl(skb, packet->private.buffer_head);
 			skb_size = header_size + look_ahead_size + bytes_txed;
 			csum.value = (typeof(csum.value))(ULONG_PTR)
 				oob_data->ext.info[TcpIpChecksumPacketInfo];
@@ -2426,7 +2746,7 @@ wstdcall void EthRxIndicateHandler(struct ndis_mp_block *nmb, void *rx_ctx,
 		}
 	} else {
 		skb_size = header_size + packet_size;
-		skb = dev_alloc_skb(skb_size);
+		skb = alloc_rx_skb(wnd, skb_size);
 		if (skb) {
 			memcpy_skb(skb, header, header_size);
 			memcpy_skb(skb, look_ahead, packet_size);
@@ -2438,10 +2758,7 @@ wstdcall void EthRxIndicateHandler(struct ndis_mp_block *nmb, void *rx_ctx,
 		skb->protocol = eth_type_trans(skb, wnd->net_dev);
 		pre_atomic_add(wnd->net_stats.rx_bytes, skb_size);
 		atomic_inc_var(wnd->net_stats.rx_packets);
-		if (in_interrupt())
-			netif_rx(skb);
-		else
-			netif_rx_ni(skb);
+		indicate_rx_skb(wnd, skb);
 	}
 
 	EXIT3(return);
@@ -2456,7 +2773,6 @@ wstdcall void NdisMTransferDataComplete(struct ndis_mp_block *nmb,
 	struct sk_buff *skb;
 	unsigned int skb_size;
 	struct ndis_packet_oob_data *oob_data;
-	ndis_buffer *buffer;
 	struct ndis_tcp_ip_checksum_packet_info csum;
 
 	ENTER3("wnd = %p, packet = %p, bytes_txed = %d",
@@ -2469,7 +2785,7 @@ wstdcall void NdisMTransferDataComplete(struct ndis_mp_block *nmb,
 	oob_data = NDIS_PACKET_OOB_DATA(packet);
 	skb_size = sizeof(oob_data->header) + oob_data->look_ahead_size +
 		bytes_txed;
-	skb = dev_alloc_skb(skb_size);
+	skb = alloc_rx_skb(wnd, skb_size);
 	if (!skb) {
 		kfree(oob_data->look_ahead);
 		NdisFreePacket(packet);
@@ -2479,12 +2795,7 @@ wstdcall void NdisMTransferDataComplete(struct ndis_mp_block *nmb,
 	}
 	memcpy_skb(skb, oob_data->header, sizeof(oob_data->header));
 	memcpy_skb(skb, oob_data->look_ahead, oob_data->look_ahead_size);
-	buffer = packet->private.buffer_head;
-	while (buffer) {
-		memcpy_skb(skb, MmGetSystemAddressForMdl(buffer),
-			   MmGetMdlByteCount(buffer));
-		buffer = buffer->next;
-	}
+	memcpy_skb_mdl(skb, packet->private.buffer_head);
 	kfree(oob_data->look_ahead);
 	NdisFreePacket(packet);
 	skb->dev = wnd->net_dev;
@@ -2501,10 +2812,7 @@ wstdcall void NdisMTransferDataComplete(struct ndis_mp_block *nmb,
 	else
 		skb->ip_summed = CHECKSUM_NONE;
 
-	if (in_interrupt())
-		netif_rx(skb);
-	else
-		netif_rx_ni(skb);
+	indicate_rx_skb(wnd, skb);
 }
 
 /* called via function pointer */
@@ -2960,7 +3268,10 @@ int ndis_init_device(struct ndis_device *wnd)
 
 	KeInitializeSpinLock(&nmb->lock);
 	wnd->mp_interrupt = NULL;
-	wnd->wrap_timer_slist.next = NULL;
+	wrap_timer_table_init(&wnd->timer_table);
+	wnd->timer_slack = WRAP_TIMER_SLACK;
+	wnd->return_packets = NULL;
+	INIT_WORK(&wnd->return_work, return_packets_worker);
 	if (wnd->wd->driver->ndis_driver)
 		wnd->wd->driver->ndis_driver->mp.shutdown = NULL;
 
@@ -3007,6 +3318,8 @@ int ndis_init(void)
 {
 	InitializeListHead(&ndis_work_list);
 	spin_lock_init(&ndis_work_list_lock);
+	InitializeListHead(&ndis_buffer_pool_list);
+	spin_lock_init(&ndis_buffer_pool_list_lock);
 	INIT_WORK(&ndis_work, ndis_worker);
 
 	ndis_wq = create_singlethread_workqueue("ndis_wq");
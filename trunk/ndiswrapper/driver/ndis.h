@@ -71,12 +71,19 @@ struct ndis_phy_addr_unit {
 
 typedef struct mdl ndis_buffer;
 
+/* free MDLs are chained in free_list through 'next' field of MDL,
+ * which is at the same offset as 'next' in nt_slist */
 struct ndis_buffer_pool {
-	ndis_buffer *free_descr;
-//	NT_SPIN_LOCK lock;
+	nt_slist_header free_list;
+	NT_SPIN_LOCK free_list_lock;
 	spinlock_t lock;
 	UINT max_descr;
 	UINT num_allocated_descr;
+	/* statistics */
+	ULONG hits;
+	ULONG misses;
+	ULONG trimmed;
+	struct nt_list list;
 };
 
 #define NDIS_PROTOCOL_ID_DEFAULT	0x00
@@ -206,14 +213,29 @@ struct ndis_task_tcp_large_send {
 
 struct ndis_packet;
 
+#define NDIS_PACKET_MAGAZINE_SIZE 16
+
+/* per-cpu cache of free packets of a pool; 'used' is number of
+ * packets allocated on this cpu less number freed on it, so it may be
+ * negative */
+struct ndis_packet_magazine {
+	UINT count;
+	int used;
+	struct ndis_packet *packets[NDIS_PACKET_MAGAZINE_SIZE];
+};
+
 struct ndis_packet_pool {
+	/* depot of free packets shared by all cpus, linked through
+	 * reserved[0] */
 	struct ndis_packet *free_descr;
 //	NT_SPIN_LOCK lock;
 	spinlock_t lock;
 	UINT max_descr;
 	UINT num_allocated_descr;
+	/* used only if magazines couldn't be allocated */
 	UINT num_used_descr;
 	UINT proto_rsvd_length;
+	struct ndis_packet_magazine *magazines;
 };
 
 struct ndis_packet_stack {
@@ -462,6 +484,8 @@ struct ndis_spinlock {
 };
 
 union ndis_rw_lock_refcount {
+	/* ndiswrapper specific: readers on this processor */
+	volatile int count;
 	UCHAR cache_line[16];
 };
 
@@ -473,11 +497,7 @@ struct ndis_rw_lock {
 		};
 		UCHAR reserved[16];
 	};
-	union {
-		union ndis_rw_lock_refcount ref_count[MAXIMUM_PROCESSORS];
-		/* ndiswrapper specific */
-		volatile int count;
-	};
+	union ndis_rw_lock_refcount ref_count[MAXIMUM_PROCESSORS];
 };
 
 struct lock_state {
@@ -485,6 +505,15 @@ struct lock_state {
 	KIRQL irql;
 };
 
+/* lock_state->state: low bits give the mode, the rest the ref_count
+ * slot used by a reader or, for a reader holding klock, whether the
+ * read is nested */
+#define RW_LOCK_STATE_READ 1
+#define RW_LOCK_STATE_WRITE 2
+#define RW_LOCK_STATE_EXCL 3
+#define RW_LOCK_STATE_MODE_MASK 3
+#define RW_LOCK_STATE_SLOT_SHIFT 2
+
 struct ndis_work_item;
 typedef void (*NDIS_PROC)(struct ndis_work_item *, void *) wstdcall;
 
@@ -611,6 +640,13 @@ enum ndis_media_stream_mode {
 	Ndis802_11MediaStreamOff, Ndis802_11MediaStreamOn
 };
 
+#define NDIS_NAPI_WEIGHT 64
+/* packets in rx_queue beyond this are dropped */
+#define MAX_RX_QUEUE_LEN 1000
+
+/* bit in tx_ring_busy, set by consumer of tx_ring */
+#define TX_RING_BUSY 0
+
 enum wrapper_work {
 	LINK_STATUS_OFF, LINK_STATUS_ON, SET_MULTICAST_LIST, COLLECT_IW_STATS,
 	HANGCHECK, NETIF_WAKEQ,
@@ -853,14 +889,32 @@ struct ndis_device {
 	BOOLEAN iw_stats_enabled;
 	struct ndis_wireless_stats ndis_stats;
 
+#ifdef WRAP_NAPI
+	/* received packets waiting for ndis_rx_poll */
+	struct napi_struct napi;
+	struct sk_buff_head rx_queue;
+#endif
+
+	/* packets indicated by deserialized driver, to be returned
+	 * with MiniportReturnPacket by return_packets_worker; linked
+	 * through reserved[0], most recent first */
+	struct ndis_packet *return_packets;
+	struct work_struct return_work;
+
 	struct work_struct tx_work;
-	struct ndis_packet *tx_ring[TX_RING_SIZE];
-	u8 tx_ring_start;
-	u8 tx_ring_end;
+	/* tx_ring_start and tx_ring_end are free running; slots are
+	 * reserved by tx_skbuff with cmpxchg on tx_ring_end and
+	 * consumed only by tx_worker; tx_ring_size is a power of 2 */
+	struct ndis_packet **tx_ring;
+	unsigned int tx_ring_size;
+	unsigned int tx_ring_start;
+	unsigned int tx_ring_end;
 	u8 is_tx_ring_full;
 	u8 tx_ok;
-	spinlock_t tx_ring_lock;
+	/* if set, tx_skbuff calls deserialized drivers directly */
+	u8 tx_direct;
 	struct mutex tx_ring_mutex;
+	unsigned long tx_ring_busy;
 	unsigned int max_tx_packets;
 	struct mutex ndis_req_mutex;
 	struct task_struct *ndis_req_task;
@@ -903,7 +957,8 @@ struct ndis_device {
 	struct v4_checksum tx_csum;
 	enum ndis_physical_medium physical_medium;
 	ULONG ndis_wolopts;
-	struct nt_slist wrap_timer_slist;
+	struct wrap_timer_table timer_table;
+	unsigned long timer_slack;
 	int drv_ndis_version;
 	struct ndis_pnp_capabilities pnp_capa;
 };
@@ -915,6 +970,9 @@ void ndis_exit(void);
 int ndis_init_device(struct ndis_device *wnd);
 void ndis_exit_device(struct ndis_device *wnd);
 
+extern struct nt_list ndis_buffer_pool_list;
+extern spinlock_t ndis_buffer_pool_list_lock;
+
 int wrap_procfs_add_ndis_device(struct ndis_device *wnd);
 void wrap_procfs_remove_ndis_device(struct ndis_device *wnd);
 
@@ -926,6 +984,7 @@ void NdisFreePacketPool(struct ndis_packet_pool *pool) wstdcall;
 void NdisAllocatePacket(NDIS_STATUS *status, struct ndis_packet **packet,
 			struct ndis_packet_pool *pool) wstdcall;
 void NdisFreePacket(struct ndis_packet *descr) wstdcall;
+UINT NdisPacketPoolUsage(struct ndis_packet_pool *pool) wstdcall;
 void NdisAllocateBufferPool(NDIS_STATUS *status,
 			    struct ndis_buffer_pool **pool_handle,
 			    UINT num_descr) wstdcall;
@@ -25,7 +25,11 @@
 #define NDIS_ESSID_MAX_SIZE 32
 #define NDIS_ENCODING_TOKEN_MAX 32
 #define MAX_ENCR_KEYS 4
+/* default size of transmit ring; the size is set with module
+ * parameter tx_ring_size or per device in procfs, and is rounded up
+ * to a power of 2 */
 #define TX_RING_SIZE 16
+#define MAX_TX_RING_SIZE 1024
 #define NDIS_MAX_RATES 8
 #define NDIS_MAX_RATES_EX 16
 
@@ -58,6 +62,8 @@
 #define MAX_DEVICE_SETTINGS 512
 
 #define MAX_ALLOCATED_URBS 15
+/* urbs preallocated for each bulk/interrupt pipe */
+#define URBS_PER_PIPE 8
 
 #define DEV_ANY_ID -1
 
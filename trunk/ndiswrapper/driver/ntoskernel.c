@@ -18,6 +18,8 @@
 #include "usb.h"
 #include "pnp.h"
 #include "loader.h"
+#include "wrapper.h"
+#include <linux/hash.h>
 #include "ntoskernel_exports.h"
 
 /* MDLs describe a range of virtual address with an array of physical
@@ -27,31 +29,74 @@
  * MDLs from a pool, the size has to be constant. So we assume that
  * maximum range used by a driver is MDL_CACHE_PAGES; if a driver
  * requests an MDL for a bigger region, we allocate it with kmalloc;
- * otherwise, we allocate from the pool */
+ * otherwise, we allocate from the pool; MDL_CACHE_PAGES is defined in
+ * ntoskernel.h */
 
-#define MDL_CACHE_PAGES 3
-#define MDL_CACHE_SIZE (sizeof(struct mdl) + \
-			(sizeof(PFN_NUMBER) * MDL_CACHE_PAGES))
 struct wrap_mdl {
 	struct nt_list list;
 	struct mdl mdl[0];
 };
 
 /* everything here is for all drivers/devices - not per driver/device */
-static spinlock_t dispatcher_lock;
+#define DISPATCHER_LOCK_HASH_BITS 6
+static spinlock_t dispatcher_locks[1 << DISPATCHER_LOCK_HASH_BITS];
+/* held while taking more than one of dispatcher_locks */
+static spinlock_t dispatcher_nest_lock;
+static spinlock_t wrap_mdl_lock;
 spinlock_t ntoskernel_lock;
 static void *mdl_cache;
 static struct nt_list wrap_mdl_list;
 
-static struct work_struct kdpc_work;
-static void kdpc_worker(struct work_struct *dummy);
+/* DPCs are queued on per-cpu queues and run by per-cpu workers (or
+ * tasklets, if dpc_tasklet is set); a DPC runs on the CPU set with
+ * KeSetTargetProcessorDpc or, if not set, on the CPU that queued it
+ * (e.g., the CPU that took the interrupt) */
+/* DPCs queued by timers are recorded, with the timer, in the queue
+ * they are queued on, so their runtime can be accounted to the timer
+ * without a global lookup or changing the driver's kdpc */
+#define KDPC_QUEUE_TIMERS 8
 
-static struct nt_list kdpc_list;
-static spinlock_t kdpc_list_lock;
+struct kdpc_queue {
+	struct nt_list list;
+	spinlock_t lock;
+	struct work_struct work;
+	struct tasklet_struct tasklet;
+	int cpu;
+	int num_timers;
+	struct {
+		struct kdpc *kdpc;
+		struct wrap_timer *wrap_timer;
+	} timers[KDPC_QUEUE_TIMERS];
+	/* timer whose DPC is running now */
+	struct wrap_timer *running_timer;
+};
+
+static DEFINE_PER_CPU(struct kdpc_queue, kdpc_queues);
+static struct workqueue_struct *kdpc_wq;
+static void kdpc_worker(struct work_struct *work);
+static void kdpc_tasklet_func(unsigned long data);
+static BOOLEAN do_queue_kdpc(struct kdpc *kdpc, struct wrap_timer *wrap_timer);
 
 static struct nt_list callback_objects;
 
-struct nt_list object_list;
+/* drivers allocate from and free to lookaside lists with inline code
+ * (as in DDK), which caches up to 'depth' entries; the depth of each
+ * list is adjusted every second from its hit/miss counters, as
+ * Windows does */
+#define LOOKASIDE_MIN_DEPTH 4
+#define LOOKASIDE_MAX_DEPTH 256
+static struct nt_list lookaside_lists;
+static spinlock_t lookaside_lock;
+static struct timer_list lookaside_timer;
+
+static struct nt_list object_list;
+
+/* threads are hashed by task and other objects by (case-insensitive)
+ * name into table of their type; readers use RCU, while writers
+ * serialize with ntoskernel_lock */
+#define OBJECT_HASH_BITS 6
+static struct list_head object_tables[OBJECT_TYPE_MAX]
+				     [1 << OBJECT_HASH_BITS];
 
 struct bus_driver {
 	struct nt_list list;
@@ -67,12 +112,17 @@ static spinlock_t ntos_work_lock;
 static void ntos_work_worker(struct work_struct *dummy);
 spinlock_t irp_cancel_lock;
 static NT_SPIN_LOCK nt_list_lock;
-static struct nt_slist wrap_timer_slist;
+
+/* timers not associated with any device */
+struct wrap_timer_table ntos_timer_table;
+static void *wrap_timer_cache;
 CCHAR cpu_count;
 
+#if LINUX_VERSION_CODE < KERNEL_VERSION(2,6,16)
 /* compute ticks (100ns) since 1601 until when system booted into
  * wrap_ticks_to_boot */
 u64 wrap_ticks_to_boot;
+#endif
 
 #if defined(CONFIG_X86_64)
 static struct timer_list shared_data_timer;
@@ -91,19 +141,74 @@ DEFINE_PER_CPU(struct irql_info, irql_info);
 #endif
 
 #if defined(CONFIG_X86_64)
+/* readers spin until high1_time matches high2_time, so high2_time is
+ * written first and high1_time last */
+static void set_ksystem_time(volatile struct ksystem_time *st, u64 time)
+{
+	st->high2_time = time >> 32;
+	smp_wmb();
+	st->low_part = time;
+	smp_wmb();
+	st->high1_time = time >> 32;
+}
+
+static void update_user_shared_data(void)
+{
+	set_ksystem_time(&kuser_shared_data.system_time, ticks_1601());
+	set_ksystem_time(&kuser_shared_data.interrupt_time, interrupt_ticks());
+	set_ksystem_time(&kuser_shared_data.tick.tick_count, jiffies);
+	kuser_shared_data.tick_count = jiffies;
+}
+
+/* only drivers that read the shared data page directly need this;
+ * the Ke/Ndis time functions compute their values on demand */
 static void update_user_shared_data_proc(unsigned long data)
 {
 	/* timer is supposed to be scheduled every 10ms, but bigger
 	 * intervals seem to work (tried up to 50ms) */
-	*((ULONG64 *)&kuser_shared_data.system_time) = ticks_1601();
-	*((ULONG64 *)&kuser_shared_data.interrupt_time) =
-		jiffies * TICKSPERSEC / HZ;
-	*((ULONG64 *)&kuser_shared_data.tick) = jiffies;
-
+	update_user_shared_data();
 	mod_timer(&shared_data_timer, jiffies + MSEC_TO_HZ(30));
 }
 #endif
 
+static u32 object_name_hash(const struct unicode_string *name)
+{
+	unsigned int i;
+	u32 hash = 0;
+
+	/* same as RtlCompareUnicodeString does for case-insensitive
+	 * comparison */
+	for (i = 0; i < name->length / sizeof(name->buf[0]); i++)
+		hash = hash * 31 + toupper((u8)name->buf[i]);
+	return hash;
+}
+
+static struct list_head *object_name_bucket(enum common_object_type type,
+					    u32 name_hash)
+{
+	return &object_tables[type][hash_32(name_hash, OBJECT_HASH_BITS)];
+}
+
+static struct list_head *nt_thread_bucket(struct task_struct *task)
+{
+	return &object_tables[OBJECT_TYPE_NT_THREAD]
+		[hash_ptr(task, OBJECT_HASH_BITS)];
+}
+
+/* takes a reference unless object is being freed */
+static BOOLEAN reference_live_object(struct common_object_header *hdr)
+{
+	UINT ref_count;
+
+	do {
+		ref_count = ACCESS_ONCE(hdr->ref_count);
+		if ((int)ref_count <= 0)
+			return FALSE;
+	} while (cmpxchg(&hdr->ref_count, ref_count, ref_count + 1) !=
+		 ref_count);
+	return TRUE;
+}
+
 void *allocate_object(ULONG size, enum common_object_type type,
 		      struct unicode_string *name)
 {
@@ -127,34 +232,97 @@ void *allocate_object(ULONG size, enum common_object_type type,
 		memcpy(hdr->name.buf, name->buf, name->max_length);
 		hdr->name.length = name->length;
 		hdr->name.max_length = name->max_length;
+		hdr->name_hash = object_name_hash(name);
 	}
 	hdr->type = type;
 	hdr->ref_count = 1;
 	spin_lock_bh(&ntoskernel_lock);
-	/* threads are looked up often (in KeWaitForXXX), so optimize
-	 * for fast lookups of threads */
-	if (type == OBJECT_TYPE_NT_THREAD)
-		InsertHeadList(&object_list, &hdr->list);
-	else
-		InsertTailList(&object_list, &hdr->list);
+	InsertTailList(&object_list, &hdr->list);
+	/* threads are hashed when their task is known */
+	if (name && type != OBJECT_TYPE_NT_THREAD) {
+		list_add_rcu(&hdr->hash_list,
+			     object_name_bucket(type, hdr->name_hash));
+		hdr->hashed = TRUE;
+	}
 	spin_unlock_bh(&ntoskernel_lock);
 	body = HEADER_TO_OBJECT(hdr);
 	TRACE3("allocated hdr: %p, body: %p", hdr, body);
 	return body;
 }
 
+wstdcall void free_object_async(void *arg1, void *arg2)
+{
+	ExFreePool(arg1);
+}
+WIN_FUNC_DECL(free_object_async,2)
+
+static void free_object_header(struct common_object_header *hdr)
+{
+	if (hdr->name.buf)
+		ExFreePool(hdr->name.buf);
+	ExFreePool(hdr);
+}
+
+static void free_object_rcu(struct rcu_head *rcu)
+{
+	struct common_object_header *hdr =
+		container_of(rcu, struct common_object_header, rcu);
+
+	/* vfree can't be used in softirq context on older kernels */
+	if (hdr->name.buf)
+		ExFreePool(hdr->name.buf);
+	if ((unsigned long)hdr >= VMALLOC_START &&
+	    (unsigned long)hdr < VMALLOC_END)
+		schedule_ntos_work_item(WIN_FUNC_PTR(free_object_async,2),
+					hdr, NULL);
+	else
+		ExFreePool(hdr);
+}
+
 static void free_object(void *object)
 {
 	struct common_object_header *hdr;
+	BOOLEAN hashed;
 
 	hdr = OBJECT_TO_HEADER(object);
 	spin_lock_bh(&ntoskernel_lock);
 	RemoveEntryList(&hdr->list);
+	hashed = hdr->hashed;
+	if (hashed)
+		list_del_rcu(&hdr->hash_list);
 	spin_unlock_bh(&ntoskernel_lock);
 	TRACE3("freed hdr: %p, body: %p", hdr, object);
-	if (hdr->name.buf)
-		ExFreePool(hdr->name.buf);
-	ExFreePool(hdr);
+	/* lookups may still be looking at hashed objects */
+	if (hashed)
+		call_rcu(&hdr->rcu, free_object_rcu);
+	else
+		free_object_header(hdr);
+}
+
+/* returns object of given type and name with a reference taken, or
+ * NULL if not found */
+void *lookup_named_object(enum common_object_type type,
+			  const struct unicode_string *name)
+{
+	struct common_object_header *hdr;
+	u32 name_hash;
+	void *object;
+
+	name_hash = object_name_hash(name);
+	object = NULL;
+	rcu_read_lock();
+	list_for_each_entry_rcu(hdr, object_name_bucket(type, name_hash),
+				hash_list) {
+		if (hdr->name_hash == name_hash && hdr->type == type &&
+		    !RtlCompareUnicodeString(&hdr->name, name, TRUE) &&
+		    reference_live_object(hdr)) {
+			object = HEADER_TO_OBJECT(hdr);
+			break;
+		}
+	}
+	rcu_read_unlock();
+	TRACE3("%d, %p", type, object);
+	return object;
 }
 
 static int add_bus_driver(const char *name)
@@ -407,55 +575,198 @@ static void initialize_object(struct dispatcher_header *dh, enum dh_type type,
 	InitializeListHead(&dh->wait_blocks);
 }
 
+#ifdef WRAP_HRTIMER
+static enum hrtimer_restart timer_proc(struct hrtimer *hrtimer)
+{
+	struct wrap_timer *wrap_timer =
+		container_of(hrtimer, struct wrap_timer, timer);
+#else
 static void timer_proc(unsigned long data)
 {
 	struct wrap_timer *wrap_timer = (struct wrap_timer *)data;
+#endif
 	struct nt_timer *nt_timer;
 	struct kdpc *kdpc;
 
 	nt_timer = wrap_timer->nt_timer;
 	TIMERENTER("%p(%p), %lu", wrap_timer, nt_timer, jiffies);
+	wrap_timer->fired++;
 #ifdef TIMER_DEBUG
 	BUG_ON(wrap_timer->wrap_timer_magic != WRAP_TIMER_MAGIC);
 	BUG_ON(nt_timer->wrap_timer_magic != WRAP_TIMER_MAGIC);
 #endif
 	KeSetEvent((struct nt_event *)nt_timer, 0, FALSE);
-	if (wrap_timer->repeat)
-		mod_timer(&wrap_timer->timer, jiffies + wrap_timer->repeat);
 	kdpc = nt_timer->kdpc;
 	if (kdpc)
-		queue_kdpc(kdpc);
+		do_queue_kdpc(kdpc, wrap_timer);
+#ifdef WRAP_HRTIMER
+	if (wrap_timer->repeat) {
+		/* forward from the previous expiry, not from now, so
+		 * periodic timers don't drift */
+		hrtimer_forward_now(hrtimer, ns_to_ktime(wrap_timer->repeat));
+		TIMEREXIT(return HRTIMER_RESTART);
+	}
+	TIMEREXIT(return HRTIMER_NORESTART);
+#else
+	if (wrap_timer->repeat)
+		mod_timer(&wrap_timer->timer, jiffies + wrap_timer->repeat);
 	TIMEREXIT(return);
+#endif
+}
+
+static struct wrap_timer *lookup_wrap_timer(struct wrap_timer_table *table,
+					    struct nt_timer *nt_timer)
+{
+	struct wrap_timer *wrap_timer;
+	struct nt_list *head;
+
+	head = &table->buckets[hash_ptr(nt_timer, WRAP_TIMER_HASH_BITS)];
+	nt_list_for_each_entry(wrap_timer, head, list) {
+		if (wrap_timer->nt_timer == nt_timer)
+			return wrap_timer;
+	}
+	return NULL;
+}
+
+/* remove record of timer's DPC from queue, if it is there; called
+ * with queue->lock held */
+static struct wrap_timer *kdpc_queue_take_timer(struct kdpc_queue *queue,
+						struct kdpc *kdpc)
+{
+	struct wrap_timer *wrap_timer;
+	int i;
+
+	for (i = 0; i < queue->num_timers; i++) {
+		if (queue->timers[i].kdpc == kdpc) {
+			wrap_timer = queue->timers[i].wrap_timer;
+			queue->timers[i] = queue->timers[--queue->num_timers];
+			return wrap_timer;
+		}
+	}
+	return NULL;
+}
+
+/* make sure no DPC queue refers to wrap_timer before it is freed */
+static void forget_timer_dpcs(struct wrap_timer *wrap_timer)
+{
+	struct kdpc_queue *queue;
+	unsigned long flags;
+	int cpu, i;
+
+	for_each_possible_cpu(cpu) {
+		queue = &per_cpu(kdpc_queues, cpu);
+		spin_lock_irqsave(&queue->lock, flags);
+		for (i = 0; i < queue->num_timers; ) {
+			if (queue->timers[i].wrap_timer == wrap_timer)
+				queue->timers[i] =
+					queue->timers[--queue->num_timers];
+			else
+				i++;
+		}
+		while (queue->running_timer == wrap_timer) {
+			spin_unlock_irqrestore(&queue->lock, flags);
+			cpu_relax();
+			spin_lock_irqsave(&queue->lock, flags);
+		}
+		spin_unlock_irqrestore(&queue->lock, flags);
+	}
+}
+
+void wrap_timer_table_init(struct wrap_timer_table *table)
+{
+	int i;
+
+	spin_lock_init(&table->lock);
+	table->count = 0;
+	for (i = 0; i < ARRAY_SIZE(table->buckets); i++)
+		InitializeListHead(&table->buckets[i]);
+}
+
+/* cancel any timers left by buggy windows driver and free them */
+void free_wrap_timers(struct wrap_timer_table *table)
+{
+	struct wrap_timer *wrap_timer;
+	struct nt_list *ent;
+	int i;
+
+	for (i = 0; i < ARRAY_SIZE(table->buckets); i++) {
+		while (1) {
+			spin_lock_bh(&table->lock);
+			ent = RemoveHeadList(&table->buckets[i]);
+			if (ent)
+				table->count--;
+			spin_unlock_bh(&table->lock);
+			if (!ent)
+				break;
+			wrap_timer = container_of(ent, struct wrap_timer, list);
+			TIMERTRACE("%p", wrap_timer);
+			wrap_timer->repeat = 0;
+			/* nt_timer that this wrap_timer is associated to
+			 * can't be touched, as it may have been freed by
+			 * the driver already */
+			if (cancel_wrap_timer(wrap_timer))
+				WARNING("Buggy Windows driver left timer %p "
+					"running", wrap_timer->nt_timer);
+			forget_timer_dpcs(wrap_timer);
+			memset(wrap_timer, 0, sizeof(*wrap_timer));
+			kmem_cache_free(wrap_timer_cache, wrap_timer);
+		}
+	}
 }
 
 void wrap_init_timer(struct nt_timer *nt_timer, enum timer_type type,
 		     struct ndis_mp_block *nmb)
 {
+	struct wrap_timer_table *table;
 	struct wrap_timer *wrap_timer;
 
-	/* TODO: if a timer is initialized more than once, we allocate
-	 * memory for wrap_timer more than once for the same nt_timer,
-	 * wasting memory. We can check if nt_timer->wrap_timer_magic is
-	 * set and not allocate, but it is not guaranteed always to be
-	 * safe */
 	TIMERENTER("%p", nt_timer);
 	/* we allocate memory for wrap_timer behind driver's back and
 	 * there is no NDIS/DDK function where this memory can be
-	 * freed, so we use slack_kmalloc so it gets freed when driver
-	 * is unloaded */
-	if (nmb)
-		wrap_timer = kzalloc(sizeof(*wrap_timer), irql_gfp());
-	else
-		wrap_timer = slack_kzalloc(sizeof(*wrap_timer));
+	 * freed, so timers are kept in a table (of the device, if
+	 * known) keyed by address of nt_timer; if a timer is
+	 * initialized again, or another timer is initialized at the
+	 * same address after the previous one was freed, the same
+	 * wrap_timer is reused. The tables are freed when device is
+	 * halted or module is unloaded */
+	table = nmb ? &nmb->wnd->timer_table : &ntos_timer_table;
+	spin_lock_bh(&table->lock);
+	wrap_timer = lookup_wrap_timer(table, nt_timer);
 	if (!wrap_timer) {
-		ERROR("couldn't allocate memory for timer");
-		return;
+		wrap_timer = kmem_cache_alloc(wrap_timer_cache, GFP_ATOMIC);
+		if (!wrap_timer) {
+			spin_unlock_bh(&table->lock);
+			ERROR("couldn't allocate memory for timer");
+			return;
+		}
+		memset(wrap_timer, 0, sizeof(*wrap_timer));
+#ifdef WRAP_HRTIMER
+		hrtimer_init(&wrap_timer->timer, CLOCK_MONOTONIC,
+			     HRTIMER_MODE_REL);
+		wrap_timer->timer.function = timer_proc;
+#else
+		init_timer(&wrap_timer->timer);
+		wrap_timer->timer.data = (unsigned long)wrap_timer;
+		wrap_timer->timer.function = timer_proc;
+#endif
+		wrap_timer->slack = nmb ? nmb->wnd->timer_slack :
+			WRAP_TIMER_SLACK;
+		wrap_timer->nt_timer = nt_timer;
+		InsertHeadList(&table->buckets[hash_ptr(nt_timer,
+							WRAP_TIMER_HASH_BITS)],
+			       &wrap_timer->list);
+		table->count++;
+		spin_unlock_bh(&table->lock);
+	} else {
+		spin_unlock_bh(&table->lock);
+		TIMERTRACE("reusing timer %p", wrap_timer);
+		/* driver shouldn't initialize a pending timer */
+		wrap_timer->repeat = 0;
+		if (cancel_wrap_timer(wrap_timer))
+			WARNING("timer %p is initialized while pending",
+				nt_timer);
+		wrap_timer->period = 0;
 	}
-
-	init_timer(&wrap_timer->timer);
-	wrap_timer->timer.data = (unsigned long)wrap_timer;
-	wrap_timer->timer.function = timer_proc;
-	wrap_timer->nt_timer = nt_timer;
 #ifdef TIMER_DEBUG
 	wrap_timer->wrap_timer_magic = WRAP_TIMER_MAGIC;
 #endif
@@ -464,15 +775,6 @@ void wrap_init_timer(struct nt_timer *nt_timer, enum timer_type type,
 	initialize_object(&nt_timer->dh, (enum dh_type)type, 0);
 	nt_timer->wrap_timer_magic = WRAP_TIMER_MAGIC;
 	TIMERTRACE("timer %p (%p)", wrap_timer, nt_timer);
-	spin_lock_bh(&ntoskernel_lock);
-	if (nmb) {
-		wrap_timer->slist.next = nmb->wnd->wrap_timer_slist.next;
-		nmb->wnd->wrap_timer_slist.next = &wrap_timer->slist;
-	} else {
-		wrap_timer->slist.next = wrap_timer_slist.next;
-		wrap_timer_slist.next = &wrap_timer->slist;
-	}
-	spin_unlock_bh(&ntoskernel_lock);
 	TIMEREXIT(return);
 }
 
@@ -490,14 +792,16 @@ wstdcall void WIN_FUNC(KeInitializeTimer,1)
 	wrap_init_timer(nt_timer, NotificationTimer, NULL);
 }
 
-/* expires and repeat are in HZ */
-BOOLEAN wrap_set_timer(struct nt_timer *nt_timer, unsigned long expires_hz,
-		       unsigned long repeat_hz, struct kdpc *kdpc)
+/* expires and repeat are in 100ns units; expires is relative to
+ * current time */
+BOOLEAN wrap_set_timer(struct nt_timer *nt_timer, u64 expires,
+		       u64 repeat, struct kdpc *kdpc)
 {
 	struct wrap_timer *wrap_timer;
+	BOOLEAN ret;
 
-	TIMERENTER("%p, %lu, %lu, %p, %lu",
-		   nt_timer, expires_hz, repeat_hz, kdpc, jiffies);
+	TIMERENTER("%p, %llu, %llu, %p, %lu",
+		   nt_timer, expires, repeat, kdpc, jiffies);
 
 	wrap_timer = nt_timer->wrap_timer;
 	TIMERTRACE("%p", wrap_timer);
@@ -518,23 +822,28 @@ BOOLEAN wrap_set_timer(struct nt_timer *nt_timer, unsigned long expires_hz,
 #endif
 	KeClearEvent((struct nt_event *)nt_timer);
 	nt_timer->kdpc = kdpc;
-	wrap_timer->repeat = repeat_hz;
-	if (mod_timer(&wrap_timer->timer, jiffies + expires_hz))
-		TIMEREXIT(return TRUE);
-	else
-		TIMEREXIT(return FALSE);
+	wrap_timer->period = repeat;
+#ifdef WRAP_HRTIMER
+	wrap_timer->repeat = repeat * 100;
+	ret = hrtimer_active(&wrap_timer->timer) ? TRUE : FALSE;
+	hrtimer_start_range_ns(&wrap_timer->timer, ns_to_ktime(expires * 100),
+			       wrap_timer->slack, HRTIMER_MODE_REL);
+#else
+	/* periodic timer fires at least every jiffy */
+	wrap_timer->repeat = repeat ? max(TICKS_TO_HZ(repeat), 1ULL) : 0;
+	ret = mod_timer(&wrap_timer->timer,
+			jiffies + TICKS_TO_HZ(expires)) ? TRUE : FALSE;
+#endif
+	TIMEREXIT(return ret);
 }
 
 wstdcall BOOLEAN WIN_FUNC(KeSetTimerEx,4)
 	(struct nt_timer *nt_timer, LARGE_INTEGER duetime_ticks,
 	 LONG period_ms, struct kdpc *kdpc)
 {
-	unsigned long expires_hz, repeat_hz;
-
 	TIMERENTER("%p, %lld, %d", nt_timer, duetime_ticks, period_ms);
-	expires_hz = SYSTEM_TIME_TO_HZ(duetime_ticks);
-	repeat_hz = MSEC_TO_HZ(period_ms);
-	return wrap_set_timer(nt_timer, expires_hz, repeat_hz, kdpc);
+	return wrap_set_timer(nt_timer, due_time_to_ticks(duetime_ticks),
+			      (u64)period_ms * TICKSPERMSEC, kdpc);
 }
 
 wstdcall BOOLEAN WIN_FUNC(KeSetTimer,3)
@@ -563,7 +872,7 @@ wstdcall BOOLEAN WIN_FUNC(KeCancelTimer,1)
 	/* disable timer before deleting so if it is periodic timer, it
 	 * won't be re-armed after deleting */
 	wrap_timer->repeat = 0;
-	ret = del_timer_sync(&wrap_timer->timer);
+	ret = cancel_wrap_timer(wrap_timer);
 	/* the documentation for KeCancelTimer suggests the DPC is
 	 * deqeued, but actually DPC is left to run */
 	if (ret)
@@ -591,81 +900,171 @@ wstdcall void WIN_FUNC(KeInitializeDpc,3)
 	InitializeListHead(&kdpc->list);
 }
 
-static void kdpc_worker(struct work_struct *dummy)
+static void run_kdpc_queue(struct kdpc_queue *queue)
 {
 	struct nt_list *entry;
 	struct kdpc *kdpc;
+	struct wrap_timer *wrap_timer = NULL;
+	ktime_t start = ktime_set(0, 0);
 	unsigned long flags;
+	s64 ns = 0;
 	KIRQL irql;
 
-	WORKENTER("");
+	WORKENTER("%d", queue->cpu);
 	irql = raise_irql(DISPATCH_LEVEL);
 	while (1) {
-		spin_lock_irqsave(&kdpc_list_lock, flags);
-		entry = RemoveHeadList(&kdpc_list);
+		if (wrap_timer)
+			ns = ktime_to_ns(ktime_sub(ktime_get(), start));
+		spin_lock_irqsave(&queue->lock, flags);
+		/* wrap_timer can't be freed while it is running_timer */
+		if (wrap_timer)
+			wrap_timer->dpc_time += ns;
+		wrap_timer = NULL;
+		entry = RemoveHeadList(&queue->list);
 		if (entry) {
 			kdpc = container_of(entry, struct kdpc, list);
-			assert(kdpc->queued);
+			assert(kdpc->queued == queue->cpu + 1);
 			kdpc->queued = 0;
+			if (queue->num_timers)
+				wrap_timer = kdpc_queue_take_timer(queue, kdpc);
 		} else
 			kdpc = NULL;
-		spin_unlock_irqrestore(&kdpc_list_lock, flags);
+		queue->running_timer = wrap_timer;
+		spin_unlock_irqrestore(&queue->lock, flags);
 		if (!kdpc)
 			break;
 		WORKTRACE("%p, %p, %p, %p, %p", kdpc, kdpc->func, kdpc->ctx,
 			  kdpc->arg1, kdpc->arg2);
-		assert_irql(_irql_ == DISPATCH_LEVEL);
+		assert_irql(_irql_ >= DISPATCH_LEVEL && _irql_ <= SOFT_IRQL);
+		if (wrap_timer)
+			start = ktime_get();
 		LIN2WIN4(kdpc->func, kdpc, kdpc->ctx, kdpc->arg1, kdpc->arg2);
-		assert_irql(_irql_ == DISPATCH_LEVEL);
+		assert_irql(_irql_ >= DISPATCH_LEVEL && _irql_ <= SOFT_IRQL);
 	}
 	lower_irql(irql);
 	WORKEXIT(return);
 }
 
+static void kdpc_worker(struct work_struct *work)
+{
+	struct kdpc_queue *queue = container_of(work, struct kdpc_queue, work);
+
+	/* with dpc_tasklet, worker is used only to get tasklet
+	 * scheduled on the target CPU */
+	if (dpc_tasklet)
+		tasklet_schedule(&queue->tasklet);
+	else
+		run_kdpc_queue(queue);
+}
+
+static void kdpc_tasklet_func(unsigned long data)
+{
+	run_kdpc_queue((struct kdpc_queue *)data);
+}
+
 wstdcall void WIN_FUNC(KeFlushQueuedDpcs,0)
 	(void)
 {
-	kdpc_worker(NULL);
+	int cpu;
+
+	/* DPCs queued on any CPU must have run when this returns */
+	flush_workqueue(kdpc_wq);
+	if (!dpc_tasklet)
+		return;
+	for_each_possible_cpu(cpu) {
+		struct kdpc_queue *queue = &per_cpu(kdpc_queues, cpu);
+		while (test_bit(TASKLET_STATE_SCHED, &queue->tasklet.state))
+			schedule_timeout_uninterruptible(1);
+		tasklet_unlock_wait(&queue->tasklet);
+	}
 }
 
-BOOLEAN queue_kdpc(struct kdpc *kdpc)
+/* 'nr_cpu' is 0 if DPC is not targeted at a CPU, otherwise target
+ * CPU + 1; 'queued' is 0 if DPC is not queued, otherwise CPU (+ 1) of
+ * the queue it is in */
+static int kdpc_cpu(struct kdpc *kdpc)
+{
+	int cpu;
+
+	if (kdpc->nr_cpu) {
+		cpu = kdpc->nr_cpu - 1;
+		if (likely(cpu_online(cpu)))
+			return cpu;
+	}
+	return raw_smp_processor_id();
+}
+
+/* wrap_timer is the timer that queues kdpc, if any */
+static BOOLEAN do_queue_kdpc(struct kdpc *kdpc, struct wrap_timer *wrap_timer)
 {
+	struct kdpc_queue *queue;
 	BOOLEAN ret;
 	unsigned long flags;
-
-	WORKENTER("%p", kdpc);
-	spin_lock_irqsave(&kdpc_list_lock, flags);
-	if (kdpc->queued)
+	int cpu;
+
+	WORKENTER("%p, %p", kdpc, wrap_timer);
+	cpu = kdpc_cpu(kdpc);
+	queue = &per_cpu(kdpc_queues, cpu);
+	spin_lock_irqsave(&queue->lock, flags);
+	/* kdpc may be queued on another CPU's queue, so check and
+	 * mark it atomically; 'queued' is changed from/to this CPU
+	 * only with this queue locked */
+	if (cmpxchg(&kdpc->queued, 0, cpu + 1))
 		ret = FALSE;
 	else {
 		if (unlikely(kdpc->importance == HighImportance))
-			InsertHeadList(&kdpc_list, &kdpc->list);
+			InsertHeadList(&queue->list, &kdpc->list);
 		else
-			InsertTailList(&kdpc_list, &kdpc->list);
-		kdpc->queued = 1;
+			InsertTailList(&queue->list, &kdpc->list);
+		/* if there is no room, DPC is just not accounted */
+		if (wrap_timer && queue->num_timers < KDPC_QUEUE_TIMERS) {
+			queue->timers[queue->num_timers].kdpc = kdpc;
+			queue->timers[queue->num_timers].wrap_timer =
+				wrap_timer;
+			queue->num_timers++;
+		}
 		ret = TRUE;
 	}
-	spin_unlock_irqrestore(&kdpc_list_lock, flags);
-	if (ret == TRUE)
-		queue_work(ntos_wq, &kdpc_work);
-	WORKTRACE("%d", ret);
+	spin_unlock_irqrestore(&queue->lock, flags);
+	if (ret == TRUE) {
+		/* tasklet runs on the CPU that schedules it */
+		if (dpc_tasklet && cpu == raw_smp_processor_id())
+			tasklet_schedule(&queue->tasklet);
+		else
+			queue_work_on(cpu, kdpc_wq, &queue->work);
+	}
+	WORKTRACE("%d, %d", ret, cpu);
 	return ret;
 }
 
+BOOLEAN queue_kdpc(struct kdpc *kdpc)
+{
+	return do_queue_kdpc(kdpc, NULL);
+}
+
 BOOLEAN dequeue_kdpc(struct kdpc *kdpc)
 {
+	struct kdpc_queue *queue;
 	BOOLEAN ret;
 	unsigned long flags;
+	int queued;
 
 	WORKENTER("%p", kdpc);
-	spin_lock_irqsave(&kdpc_list_lock, flags);
-	if (kdpc->queued) {
-		RemoveEntryList(&kdpc->list);
-		kdpc->queued = 0;
-		ret = TRUE;
-	} else
-		ret = FALSE;
-	spin_unlock_irqrestore(&kdpc_list_lock, flags);
+	ret = FALSE;
+	while ((queued = ACCESS_ONCE(kdpc->queued))) {
+		queue = &per_cpu(kdpc_queues, queued - 1);
+		spin_lock_irqsave(&queue->lock, flags);
+		if (kdpc->queued == queued) {
+			RemoveEntryList(&kdpc->list);
+			kdpc->queued = 0;
+			if (queue->num_timers)
+				kdpc_queue_take_timer(queue, kdpc);
+			ret = TRUE;
+		}
+		spin_unlock_irqrestore(&queue->lock, flags);
+		if (ret == TRUE)
+			break;
+	}
 	WORKTRACE("%d", ret);
 	return ret;
 }
@@ -691,6 +1090,16 @@ wstdcall void WIN_FUNC(KeSetImportanceDpc,2)
 	kdpc->importance = importance;
 }
 
+wstdcall void WIN_FUNC(KeSetTargetProcessorDpc,2)
+	(struct kdpc *kdpc, CCHAR cpu)
+{
+	ENTER3("%p, %d", kdpc, cpu);
+	if ((UCHAR)cpu < 255 && (UCHAR)cpu < nr_cpu_ids)
+		kdpc->nr_cpu = (UCHAR)cpu + 1;
+	else
+		WARNING("invalid cpu %d", cpu);
+}
+
 static void ntos_work_worker(struct work_struct *dummy)
 {
 	struct ntos_work_item *ntos_work_item;
@@ -733,6 +1142,200 @@ int schedule_ntos_work_item(NTOS_WORK_FUNC func, void *arg1, void *arg2)
 	WORKEXIT(return 0);
 }
 
+#ifdef CONFIG_SMP
+
+/* queue entries for spinlocks acquired without an in-stack handle; a
+ * processor needs one for each spinlock it holds or waits for, which
+ * includes locks taken in nested interrupt context. If a processor
+ * runs out of them, entries are allocated and kept in
+ * nt_spin_lock_overflow until the lock is released */
+#define NT_SPIN_LOCK_NODES 8
+
+struct nt_spin_lock_node {
+	NT_SPIN_LOCK *volatile key;
+	struct kspin_lock_queue queue;
+	/* only for entries in nt_spin_lock_overflow */
+	struct nt_list list;
+	BOOLEAN overflow;
+};
+
+struct nt_spin_lock_nodes {
+	struct nt_spin_lock_node node[NT_SPIN_LOCK_NODES];
+};
+
+static DEFINE_PER_CPU(struct nt_spin_lock_nodes, nt_spin_lock_nodes);
+
+static struct nt_list nt_spin_lock_overflow;
+static spinlock_t nt_spin_lock_overflow_lock;
+
+struct nt_spin_lock_site nt_spin_lock_sites[1 << NT_SPIN_LOCK_SITE_BITS];
+
+static struct kspin_lock_queue *get_spin_lock_node(NT_SPIN_LOCK *lock)
+{
+	struct nt_spin_lock_nodes *nodes;
+	struct nt_spin_lock_node *node;
+	unsigned long flags;
+	bool warned = false;
+	int i;
+
+	while (1) {
+		nodes = &per_cpu(nt_spin_lock_nodes, raw_smp_processor_id());
+		for (i = 0; i < NT_SPIN_LOCK_NODES; i++) {
+			node = &nodes->node[i];
+			if (node->key == NULL &&
+			    cmpxchg(&node->key, NULL, lock) == NULL)
+				return &node->queue;
+		}
+		node = kzalloc(sizeof(*node), GFP_ATOMIC);
+		if (node) {
+			node->key = lock;
+			node->overflow = TRUE;
+			spin_lock_irqsave(&nt_spin_lock_overflow_lock, flags);
+			InsertTailList(&nt_spin_lock_overflow, &node->list);
+			spin_unlock_irqrestore(&nt_spin_lock_overflow_lock,
+					       flags);
+			return &node->queue;
+		}
+		/* wait for an entry on this processor to be released
+		 * or memory to become available */
+		if (!warned) {
+			ERROR("too many spinlocks held on cpu %d",
+			      raw_smp_processor_id());
+			warned = true;
+		}
+		cpu_relax();
+	}
+}
+
+static struct nt_spin_lock_node *find_spin_lock_node(NT_SPIN_LOCK *lock)
+{
+	struct nt_spin_lock_nodes *nodes;
+	struct nt_spin_lock_node *node, *cur;
+	unsigned long flags;
+	int cpu, i;
+
+	/* lock is normally released on the processor that acquired
+	 * it; other processors may also have an entry for the same
+	 * lock while waiting for it, so only owner's entry, without
+	 * LOCK_QUEUE_WAIT, matches */
+	nodes = &per_cpu(nt_spin_lock_nodes, raw_smp_processor_id());
+	for (i = 0; i < NT_SPIN_LOCK_NODES; i++) {
+		if (nodes->node[i].key == lock &&
+		    nodes->node[i].queue.lock == lock)
+			return &nodes->node[i];
+	}
+	for_each_possible_cpu(cpu) {
+		nodes = &per_cpu(nt_spin_lock_nodes, cpu);
+		for (i = 0; i < NT_SPIN_LOCK_NODES; i++) {
+			if (nodes->node[i].key == lock &&
+			    nodes->node[i].queue.lock == lock)
+				return &nodes->node[i];
+		}
+	}
+	node = NULL;
+	spin_lock_irqsave(&nt_spin_lock_overflow_lock, flags);
+	nt_list_for_each_entry(cur, &nt_spin_lock_overflow, list) {
+		if (cur->key == lock && cur->queue.lock == lock) {
+			node = cur;
+			break;
+		}
+	}
+	spin_unlock_irqrestore(&nt_spin_lock_overflow_lock, flags);
+	return node;
+}
+
+static void account_spin_lock_contention(void *site, unsigned long spins)
+{
+	struct nt_spin_lock_site *lock_site;
+	unsigned int i, h;
+	void *cur;
+
+	h = hash_ptr(site, NT_SPIN_LOCK_SITE_BITS);
+	for (i = 0; i < ARRAY_SIZE(nt_spin_lock_sites); i++) {
+		lock_site = &nt_spin_lock_sites[(h + i) &
+						 (ARRAY_SIZE(nt_spin_lock_sites) - 1)];
+		cur = ACCESS_ONCE(lock_site->site);
+		if (cur == NULL)
+			cur = cmpxchg(&lock_site->site, NULL, site) ? : site;
+		if (cur != site)
+			continue;
+		atomic_inc(&lock_site->contended);
+		atomic_long_add(spins, &lock_site->spins);
+		return;
+	}
+	/* table is full; contention at this site is not accounted */
+}
+
+void nt_queued_spin_lock(NT_SPIN_LOCK *lock, struct kspin_lock_queue *queue,
+			 void *site)
+{
+	struct kspin_lock_queue *prev;
+	unsigned long spins;
+
+	if (!queue)
+		queue = get_spin_lock_node(lock);
+	queue->next = NULL;
+	queue->lock = (NT_SPIN_LOCK *)((ULONG_PTR)lock | LOCK_QUEUE_WAIT);
+	prev = (struct kspin_lock_queue *)xchg(lock, (ULONG_PTR)queue);
+	if (likely(prev == NULL)) {
+		queue->lock = lock;
+		return;
+	}
+	ACCESS_ONCE(prev->next) = queue;
+	spins = 0;
+	while ((ULONG_PTR)ACCESS_ONCE(queue->lock) & LOCK_QUEUE_WAIT) {
+		cpu_relax();
+		spins++;
+	}
+	smp_mb();
+	account_spin_lock_contention(site, spins);
+}
+
+void nt_queued_spin_unlock(NT_SPIN_LOCK *lock, struct kspin_lock_queue *queue)
+{
+	struct nt_spin_lock_node *node = NULL;
+	struct kspin_lock_queue *next;
+	unsigned long flags;
+
+	if (!queue) {
+		node = find_spin_lock_node(lock);
+		if (!node) {
+			WARNING("unlocking unlocked spinlock: 0x%lx at %p",
+				(unsigned long)*lock, lock);
+			return;
+		}
+		queue = &node->queue;
+	}
+	next = ACCESS_ONCE(queue->next);
+	if (next == NULL) {
+		if (cmpxchg(lock, (ULONG_PTR)queue, NT_SPIN_LOCK_UNLOCKED) ==
+		    (ULONG_PTR)queue)
+			goto out;
+		/* a waiter has swapped itself in, but not linked to
+		 * us yet */
+		while ((next = ACCESS_ONCE(queue->next)) == NULL)
+			cpu_relax();
+	}
+	smp_mb();
+	ACCESS_ONCE(next->lock) = lock;
+out:
+	queue->lock = NULL;
+	if (node) {
+		if (node->overflow) {
+			spin_lock_irqsave(&nt_spin_lock_overflow_lock, flags);
+			RemoveEntryList(&node->list);
+			spin_unlock_irqrestore(&nt_spin_lock_overflow_lock,
+					       flags);
+			kfree(node);
+			return;
+		}
+		smp_wmb();
+		node->key = NULL;
+	}
+}
+
+#endif // CONFIG_SMP
+
 wstdcall void WIN_FUNC(KeInitializeSpinLock,1)
 	(NT_SPIN_LOCK *lock)
 {
@@ -802,18 +1405,7 @@ wstdcall void *WIN_FUNC(ExAllocatePoolWithTag,3)
 
 	ENTER4("pool_type: %d, size: %zu, tag: 0x%x", pool_type, size, tag);
 	assert_irql(_irql_ <= DISPATCH_LEVEL);
-	if (size < PAGE_SIZE)
-		addr = kmalloc(size, irql_gfp());
-	else {
-		if (irql_gfp() & GFP_ATOMIC) {
-			addr = __vmalloc(size, GFP_ATOMIC | __GFP_HIGHMEM,
-					 PAGE_KERNEL);
-			TRACE1("%p, %zu", addr, size);
-		} else {
-			addr = vmalloc(size);
-			TRACE1("%p, %zu", addr, size);
-		}
-	}
+	addr = wrap_pool_alloc(size, tag, irql_gfp());
 	DBG_BLOCK(1) {
 		if (addr)
 			TRACE4("addr: %p, %zu", addr, size);
@@ -828,12 +1420,7 @@ wstdcall void WIN_FUNC(ExFreePoolWithTag,2)
 	(void *addr, ULONG tag)
 {
 	TRACE4("%p", addr);
-	if ((unsigned long)addr < VMALLOC_START ||
-	    (unsigned long)addr >= VMALLOC_END)
-		kfree(addr);
-	else
-		vfree(addr);
-
+	wrap_pool_free(addr);
 	EXIT4(return);
 }
 
@@ -844,6 +1431,55 @@ wstdcall void WIN_FUNC(ExFreePool,1)
 }
 WIN_FUNC_DECL(ExFreePool,1)
 
+static void adjust_lookaside_depth(struct npaged_lookaside_list *lookaside)
+{
+	ULONG allocs, misses, miss_rate;
+	int depth = lookaside->depth;
+
+	allocs = lookaside->totalallocs - lookaside->lasttotallocs;
+	misses = lookaside->u1.allocmisses - lookaside->u3.lastallocmisses;
+	lookaside->lasttotallocs = lookaside->totalallocs;
+	lookaside->u3.lastallocmisses = lookaside->u1.allocmisses;
+
+	if (allocs < 75) {
+		/* not used much; shrink slowly */
+		depth--;
+	} else {
+		/* miss rate per 1000 allocations */
+		if (misses < allocs) {
+			u64 rate = (u64)misses * 1000;
+			do_div(rate, allocs);
+			miss_rate = rate;
+		} else
+			miss_rate = 1000;
+		if (miss_rate < 5)
+			depth--;
+		else
+			depth += min_t(int, ((lookaside->maxdepth - depth) *
+					     miss_rate) / 2000 + 5, 30);
+	}
+	if (depth < LOOKASIDE_MIN_DEPTH)
+		depth = LOOKASIDE_MIN_DEPTH;
+	else if (depth > lookaside->maxdepth)
+		depth = lookaside->maxdepth;
+	if (depth != lookaside->depth)
+		TRACE3("%p: %u -> %d (%u, %u)", lookaside, lookaside->depth,
+		       depth, allocs, misses);
+	lookaside->depth = depth;
+}
+
+static void lookaside_timer_proc(unsigned long data)
+{
+	struct npaged_lookaside_list *lookaside;
+
+	spin_lock_bh(&lookaside_lock);
+	nt_list_for_each_entry(lookaside, &lookaside_lists, list)
+		adjust_lookaside_depth(lookaside);
+	if (!IsListEmpty(&lookaside_lists))
+		mod_timer(&lookaside_timer, jiffies + HZ);
+	spin_unlock_bh(&lookaside_lock);
+}
+
 wstdcall void WIN_FUNC(ExInitializeNPagedLookasideList,7)
 	(struct npaged_lookaside_list *lookaside,
 	 LOOKASIDE_ALLOC_FUNC *alloc_func, LOOKASIDE_FREE_FUNC *free_func,
@@ -857,8 +1493,9 @@ wstdcall void WIN_FUNC(ExInitializeNPagedLookasideList,7)
 
 	lookaside->size = size;
 	lookaside->tag = tag;
-	lookaside->depth = 4;
-	lookaside->maxdepth = 256;
+	/* depth argument is not used, as on Windows */
+	lookaside->depth = LOOKASIDE_MIN_DEPTH;
+	lookaside->maxdepth = LOOKASIDE_MAX_DEPTH;
 	lookaside->pool_type = NonPagedPool;
 
 	if (alloc_func)
@@ -873,6 +1510,11 @@ wstdcall void WIN_FUNC(ExInitializeNPagedLookasideList,7)
 #ifndef CONFIG_X86_64
 	nt_spin_lock_init(&lookaside->obsolete);
 #endif
+	spin_lock_bh(&lookaside_lock);
+	if (IsListEmpty(&lookaside_lists))
+		mod_timer(&lookaside_timer, jiffies + HZ);
+	InsertTailList(&lookaside_lists, &lookaside->list);
+	spin_unlock_bh(&lookaside_lock);
 	EXIT3(return);
 }
 
@@ -882,6 +1524,12 @@ wstdcall void WIN_FUNC(ExDeleteNPagedLookasideList,1)
 	struct nt_slist *entry;
 
 	ENTER3("lookaside = %p", lookaside);
+	spin_lock_bh(&lookaside_lock);
+	RemoveEntryList(&lookaside->list);
+	spin_unlock_bh(&lookaside_lock);
+	TRACE3("%u, %u, %u, %u", lookaside->totalallocs,
+	       lookaside->u1.allocmisses, lookaside->totalfrees,
+	       lookaside->u2.freemisses);
 	while ((entry = ExpInterlockedPopEntrySList(&lookaside->head)))
 		LIN2WIN1(lookaside->free_func, entry);
 	EXIT3(return);
@@ -975,13 +1623,84 @@ wstdcall void WIN_FUNC(ExNotifyCallback,3)
 	return;
 }
 
-/* check and set signaled state; should be called with dispatcher_lock held */
+/* dispatcher objects are protected by locks hashed on their address;
+ * waiting on multiple objects takes several of them, always in the
+ * order of their index and under dispatcher_nest_lock, so lockdep
+ * counts them as one held lock instead of one per object (a wait on
+ * MAX_WAIT_OBJECTS objects would otherwise exceed lockdep's depth);
+ * the locks are taken with irqs disabled, as timers (hrtimers) may
+ * signal objects in interrupt context */
+static inline unsigned int dispatcher_lock_index(struct dispatcher_header *dh)
+{
+	return hash_ptr(dh, DISPATCHER_LOCK_HASH_BITS);
+}
+
+static inline spinlock_t *dispatcher_lock(struct dispatcher_header *dh)
+{
+	return &dispatcher_locks[dispatcher_lock_index(dh)];
+}
+
+struct dispatcher_lock_set {
+	int n;
+	unsigned long flags;
+	u8 index[MAX_WAIT_OBJECTS];
+};
+
+static void lock_dispatcher_objects(struct dispatcher_lock_set *set,
+				    ULONG count, void *object[])
+{
+	unsigned int index;
+	int i, j, k;
+
+	/* keep indices sorted and unique */
+	set->n = 0;
+	for (i = 0; i < count; i++) {
+		index = dispatcher_lock_index(object[i]);
+		for (j = 0; j < set->n && set->index[j] < index; j++)
+			;
+		if (j < set->n && set->index[j] == index)
+			continue;
+		for (k = set->n; k > j; k--)
+			set->index[k] = set->index[k - 1];
+		set->index[j] = index;
+		set->n++;
+	}
+	if (set->n == 1) {
+		spin_lock_irqsave(&dispatcher_locks[set->index[0]],
+				  set->flags);
+		return;
+	}
+	spin_lock_irqsave(&dispatcher_nest_lock, set->flags);
+	for (i = 0; i < set->n; i++)
+		spin_lock_nest_lock(&dispatcher_locks[set->index[i]],
+				    &dispatcher_nest_lock);
+}
+
+static void unlock_dispatcher_objects(struct dispatcher_lock_set *set)
+{
+	int i;
+
+	if (set->n == 1) {
+		spin_unlock_irqrestore(&dispatcher_locks[set->index[0]],
+				       set->flags);
+		return;
+	}
+	for (i = set->n - 1; i >= 0; i--)
+		spin_unlock(&dispatcher_locks[set->index[i]]);
+	spin_unlock_irqrestore(&dispatcher_nest_lock, set->flags);
+}
+
+/* check and set signaled state; should be called with object's
+ * dispatcher_lock held, except for notification events and threads
+ * (see KeWaitForSingleObject) */
 /* @grab indicates if the event should be grabbed or checked
  * - note that a semaphore may stay in signaled state for multiple
  * 'grabs' if the count is > 1 */
 static int grab_object(struct dispatcher_header *dh,
 		       struct task_struct *thread, int grab)
 {
+	LONG state;
+
 	EVENTTRACE("%p, %p, %d, %d", dh, thread, grab, dh->signal_state);
 	if (unlikely(is_mutex_object(dh))) {
 		struct nt_mutex *nt_mutex;
@@ -1001,17 +1720,22 @@ static int grab_object(struct dispatcher_header *dh,
 			}
 			EVENTEXIT(return 1);
 		}
-	} else if (dh->signal_state > 0) {
-		/* to grab, decrement signal_state for synchronization
-		 * or semaphore objects */
-		if (grab && (is_synch_object(dh) || is_semaphore_object(dh)))
-			dh->signal_state--;
-		EVENTEXIT(return 1);
+		EVENTEXIT(return 0);
+	}
+	/* events may be set (and reset) without the lock, so
+	 * signal_state of synchronization objects is decremented
+	 * atomically */
+	while ((state = ACCESS_ONCE(dh->signal_state)) > 0) {
+		if (!grab ||
+		    !(is_synch_object(dh) || is_semaphore_object(dh)))
+			EVENTEXIT(return 1);
+		if (cmpxchg(&dh->signal_state, state, state - 1) == state)
+			EVENTEXIT(return 1);
 	}
 	EVENTEXIT(return 0);
 }
 
-/* this function should be called holding dispatcher_lock */
+/* this function should be called holding object's dispatcher_lock */
 static void object_signaled(struct dispatcher_header *dh)
 {
 	struct nt_list *cur, *next;
@@ -1022,12 +1746,24 @@ static void object_signaled(struct dispatcher_header *dh)
 		wb = container_of(cur, struct wait_block, list);
 		assert(wb->thread != NULL);
 		assert(wb->object == NULL);
-		if (!grab_object(dh, wb->thread, 1))
+		if (!grab_object(dh, wb->thread, 0))
 			continue;
+		/* WaitAny is satisfied by only one object; other
+		 * objects (protected by other locks) may be signaled
+		 * at the same time, so claim the wait first */
+		if (wb->wait_type == WaitAny) {
+			if (cmpxchg(wb->wait_done, 0, 1))
+				continue;
+		} else
+			*(wb->wait_done) = 1;
+		/* with the lock held, only KeResetEvent can change
+		 * the state since it was checked; the grab then
+		 * fails, which is the same as grabbing the event just
+		 * before it was reset */
+		grab_object(dh, wb->thread, 1);
 		EVENTTRACE("%p (%p): waking %p", dh, wb, wb->thread);
 		RemoveEntryList(cur);
 		wb->object = dh;
-		*(wb->wait_done) = 1;
 		wake_up_process(wb->thread);
 	}
 	EVENTEXIT(return);
@@ -1039,15 +1775,16 @@ wstdcall NTSTATUS WIN_FUNC(KeWaitForMultipleObjects,8)
 	 BOOLEAN alertable, LARGE_INTEGER *timeout,
 	 struct wait_block *wait_block_array)
 {
-	int i, res = 0, wait_count, wait_done;
+	int i, j, res = 0, wait_count, wait_done;
 	typeof(jiffies) wait_hz = 0;
 	struct wait_block *wb, wb_array[THREAD_WAIT_OBJECTS];
 	struct dispatcher_header *dh;
+	struct dispatcher_lock_set locks;
 	KIRQL irql = current_irql();
 
 	EVENTENTER("%p, %d, %u, %p", current, count, wait_type, timeout);
 
-	if (count > MAX_WAIT_OBJECTS ||
+	if (count == 0 || count > MAX_WAIT_OBJECTS ||
 	    (count > THREAD_WAIT_OBJECTS && wait_block_array == NULL))
 		EVENTEXIT(return STATUS_INVALID_PARAMETER);
 
@@ -1056,22 +1793,22 @@ wstdcall NTSTATUS WIN_FUNC(KeWaitForMultipleObjects,8)
 	else
 		wb = wait_block_array;
 
-	/* If *timeout == 0: In the case of WaitAny, if an object can
-	 * be grabbed (object is in signaled state), grab and
-	 * return. In the case of WaitAll, we have to first make sure
-	 * all objects can be grabbed. If any/some of them can't be
-	 * grabbed, either we return STATUS_TIMEOUT or wait for them,
-	 * depending on how to satisfy wait. If all of them can be
-	 * grabbed, we will grab them in the next loop below */
+	/* In the case of WaitAny, if an object can be grabbed (object
+	 * is in signaled state), grab and return. In the case of
+	 * WaitAll, we have to first make sure all objects can be
+	 * grabbed. If any/some of them can't be grabbed, either we
+	 * return STATUS_TIMEOUT or wait for them, depending on how to
+	 * satisfy wait. If all of them can be grabbed, grab them and
+	 * return */
 
-	spin_lock_bh(&dispatcher_lock);
+	lock_dispatcher_objects(&locks, count, object);
 	for (i = wait_count = 0; i < count; i++) {
 		dh = object[i];
 		EVENTTRACE("%p: event %p (%d)", current, dh, dh->signal_state);
 		/* wait_type == 1 for WaitAny, 0 for WaitAll */
 		if (grab_object(dh, current, wait_type)) {
 			if (wait_type == WaitAny) {
-				spin_unlock_bh(&dispatcher_lock);
+				unlock_dispatcher_objects(&locks);
 				EVENTEXIT(return STATUS_WAIT_0 + i);
 			}
 		} else {
@@ -1080,59 +1817,90 @@ wstdcall NTSTATUS WIN_FUNC(KeWaitForMultipleObjects,8)
 		}
 	}
 
-	if (timeout && *timeout == 0 && wait_count) {
-		spin_unlock_bh(&dispatcher_lock);
+	if (wait_count == 0) {
+		for (i = 0; i < count; i++)
+			grab_object(object[i], current, 1);
+		unlock_dispatcher_objects(&locks);
+		EVENTEXIT(return STATUS_SUCCESS);
+	}
+
+	if (timeout && *timeout == 0) {
+		unlock_dispatcher_objects(&locks);
 		EVENTEXIT(return STATUS_TIMEOUT);
 	}
 
-	/* get the list of objects the thread needs to wait on and add
-	 * the thread on the wait list for each such object */
-	/* if *timeout == 0, this step will grab all the objects */
+	if (irql >= DISPATCH_LEVEL) {
+		unlock_dispatcher_objects(&locks);
+		WARNING("attempt to wait with irql %d", irql);
+		EVENTEXIT(return STATUS_INVALID_PARAMETER);
+	}
+
+	/* add the thread on the wait list of each object; objects
+	 * that are (or become) signaled are grabbed by
+	 * object_signaled as for any other waiter */
 	wait_done = 0;
 	for (i = 0; i < count; i++) {
 		dh = object[i];
-		EVENTTRACE("%p: event %p (%d)", current, dh, dh->signal_state);
 		wb[i].object = NULL;
-		if (grab_object(dh, current, 1)) {
-			EVENTTRACE("%p: no wait for %p (%d)",
-				   current, dh, dh->signal_state);
-			/* mark that we are not waiting on this object */
-			wb[i].thread = NULL;
-		} else {
-			wb[i].wait_done = &wait_done;
-			wb[i].thread = current;
-			EVENTTRACE("%p: wait for %p", current, dh);
-			InsertTailList(&dh->wait_blocks, &wb[i].list);
-		}
+		wb[i].thread = current;
+		wb[i].wait_done = &wait_done;
+		wb[i].wait_type = wait_type;
+		InsertTailList(&dh->wait_blocks, &wb[i].list);
 	}
-	spin_unlock_bh(&dispatcher_lock);
-	if (wait_count == 0)
-		EVENTEXIT(return STATUS_SUCCESS);
+	/* KeSetEvent doesn't take the lock if no one is waiting, so
+	 * check objects again now that wait blocks are visible */
+	smp_mb();
+	for (i = 0; i < count; i++) {
+		if (grab_object(object[i], current, 0))
+			object_signaled(object[i]);
+	}
+	unlock_dispatcher_objects(&locks);
 
-	assert(timeout == NULL || *timeout != 0);
+	if (wait_type == WaitAny)
+		wait_count = 1;
+	else
+		wait_count = count;
 	if (timeout == NULL)
 		wait_hz = 0;
 	else
 		wait_hz = SYSTEM_TIME_TO_HZ(*timeout);
 
-	if (irql >= DISPATCH_LEVEL) {
-		WARNING("attempt to wait with irql %d", irql);
-		EVENTEXIT(return STATUS_INVALID_PARAMETER);
-	}
 	EVENTTRACE("%p: sleep for %ld on %p", current, wait_hz, &wait_done);
 	/* we don't honor 'alertable' - according to description for
 	 * this, even if waiting in non-alertable state, thread may be
 	 * alerted in some circumstances */
-	while (wait_count) {
+	while (1) {
 		res = wait_condition(wait_done, wait_hz, TASK_INTERRUPTIBLE);
-		spin_lock_bh(&dispatcher_lock);
+		lock_dispatcher_objects(&locks, count, object);
 		EVENTTRACE("%p woke up: %d, %d", current, res, wait_done);
 		/* the event may have been set by the time
 		 * wrap_wait_event returned and spinlock obtained, so
-		 * don't rely on value of 'res' - check event status */
-		if (!wait_done) {
-			assert(res <= 0);
-			/* timed out or interrupted; remove from wait list */
+		 * don't rely on value of 'res' - check which objects
+		 * have been grabbed for this thread */
+		for (i = 0; i < count; i++) {
+			if (!wb[i].thread || !wb[i].object)
+				continue;
+			assert(wb[i].object == object[i]);
+			/* this wait block is done */
+			wb[i].thread = NULL;
+			wait_count--;
+			if (wait_type == WaitAny) {
+				/* done; remove from rest of wait list */
+				for (j = 0; j < count; j++) {
+					if (wb[j].thread)
+						RemoveEntryList(&wb[j].list);
+				}
+				unlock_dispatcher_objects(&locks);
+				EVENTEXIT(return STATUS_WAIT_0 + i);
+			}
+		}
+		if (wait_count == 0) {
+			unlock_dispatcher_objects(&locks);
+			EVENTEXIT(return STATUS_SUCCESS);
+		}
+		if (res <= 0) {
+			/* timed out or interrupted; remove from wait
+			 * list */
 			for (i = 0; i < count; i++) {
 				if (!wb[i].thread)
 					continue;
@@ -1141,57 +1909,50 @@ wstdcall NTSTATUS WIN_FUNC(KeWaitForMultipleObjects,8)
 				assert(wb[i].object == NULL);
 				RemoveEntryList(&wb[i].list);
 			}
-			spin_unlock_bh(&dispatcher_lock);
+			unlock_dispatcher_objects(&locks);
 			if (res < 0)
 				EVENTEXIT(return STATUS_ALERTED);
 			else
 				EVENTEXIT(return STATUS_TIMEOUT);
 		}
-		assert(res > 0);
-		/* woken because object(s) signaled */
-		for (i = 0; wait_count && i < count; i++) {
-			if (!wb[i].thread || !wb[i].object)
-				continue;
-			DBG_BLOCK(1) {
-				if (wb[i].object != object[i]) {
-					EVENTTRACE("oops %p != %p",
-						   wb[i].object, object[i]);
-					continue;
-				}
-			}
-			wait_count--;
-			if (wait_type == WaitAny) {
-				int j;
-				/* done; remove from rest of wait list */
-				for (j = i + 1; j < count; j++) {
-					if (wb[j].thread && !wb[j].object)
-						RemoveEntryList(&wb[j].list);
-				}
-				spin_unlock_bh(&dispatcher_lock);
-				EVENTEXIT(return STATUS_WAIT_0 + i);
-			}
-		}
-		wait_done = 0;
-		spin_unlock_bh(&dispatcher_lock);
-		if (wait_count == 0)
-			EVENTEXIT(return STATUS_SUCCESS);
-
 		/* this thread is still waiting for more objects, so
 		 * let it wait for remaining time and those objects */
+		wait_done = 0;
+		unlock_dispatcher_objects(&locks);
 		if (timeout)
 			wait_hz = res;
 		else
 			wait_hz = 0;
 	}
-	/* should never reach here, but compiler wants return value */
-	ERROR("%p: wait_hz: %ld", current, wait_hz);
-	EVENTEXIT(return STATUS_SUCCESS);
 }
 
 wstdcall NTSTATUS WIN_FUNC(KeWaitForSingleObject,5)
 	(void *object, KWAIT_REASON wait_reason, KPROCESSOR_MODE wait_mode,
 	 BOOLEAN alertable, LARGE_INTEGER *timeout)
 {
+	struct dispatcher_header *dh = object;
+	int grabbed;
+
+	EVENTENTER("%p, %p, %p", current, dh, timeout);
+	/* notification events (and threads) are not changed by
+	 * grabbing them, so they can be checked without the lock;
+	 * objects that are consumed by a grab are grabbed only with
+	 * the lock held, so a waiter in object_signaled that has
+	 * found one signaled can't lose it to this thread */
+	if (is_mutex_object(dh) || is_semaphore_object(dh) ||
+	    is_synch_object(dh)) {
+		spinlock_t *lock = dispatcher_lock(dh);
+		unsigned long flags;
+		spin_lock_irqsave(lock, flags);
+		grabbed = grab_object(dh, current, 1);
+		spin_unlock_irqrestore(lock, flags);
+	} else
+		grabbed = grab_object(dh, current, 1);
+	if (grabbed)
+		EVENTEXIT(return STATUS_WAIT_0);
+	if (timeout && *timeout == 0)
+		EVENTEXIT(return STATUS_TIMEOUT);
+	/* need to sleep */
 	return KeWaitForMultipleObjects(1, &object, WaitAny, wait_reason,
 					wait_mode, alertable, timeout, NULL);
 }
@@ -1207,17 +1968,38 @@ wstdcall void WIN_FUNC(KeInitializeEvent,3)
 wstdcall LONG WIN_FUNC(KeSetEvent,3)
 	(struct nt_event *nt_event, KPRIORITY incr, BOOLEAN wait)
 {
+	struct dispatcher_header *dh = &nt_event->dh;
+	spinlock_t *lock;
+	unsigned long flags;
 	LONG old_state;
+	BOOLEAN set = FALSE;
 
 	EVENTENTER("%p, %d", nt_event, nt_event->dh.type);
 	if (wait == TRUE)
 		WARNING("wait = %d, not yet implemented", wait);
-	spin_lock_bh(&dispatcher_lock);
-	old_state = nt_event->dh.signal_state;
-	nt_event->dh.signal_state = 1;
-	if (old_state == 0)
-		object_signaled(&nt_event->dh);
-	spin_unlock_bh(&dispatcher_lock);
+	/* if no one is waiting, lock is not needed; xchg is a full
+	 * barrier: either a thread adding itself to wait_blocks sees
+	 * the event signaled, or we see it waiting (see
+	 * KeWaitForMultipleObjects) */
+	if (IsListEmpty(&dh->wait_blocks)) {
+		old_state = xchg(&dh->signal_state, 1);
+		if (likely(IsListEmpty(&dh->wait_blocks)))
+			EVENTEXIT(return old_state);
+		set = TRUE;
+	}
+	lock = dispatcher_lock(dh);
+	spin_lock_irqsave(lock, flags);
+	if (!set)
+		old_state = dh->signal_state;
+	/* an event set without the lock is handed to waiters that
+	 * have come since, before it is set again, so a set is not
+	 * lost on an event that is already signaled */
+	object_signaled(dh);
+	if (!set) {
+		xchg(&dh->signal_state, 1);
+		object_signaled(dh);
+	}
+	spin_unlock_irqrestore(lock, flags);
 	EVENTEXIT(return old_state);
 }
 
@@ -1267,12 +2049,15 @@ wstdcall LONG WIN_FUNC(KeReleaseMutex,2)
 {
 	LONG ret;
 	struct task_struct *thread;
+	spinlock_t *lock;
+	unsigned long flags;
 
 	EVENTENTER("%p, %d, %p", mutex, wait, current);
 	if (wait == TRUE)
 		WARNING("wait: %d", wait);
 	thread = current;
-	spin_lock_bh(&dispatcher_lock);
+	lock = dispatcher_lock(&mutex->dh);
+	spin_lock_irqsave(lock, flags);
 	EVENTTRACE("%p, %p, %p, %d", mutex, thread, mutex->owner_thread,
 		   mutex->dh.signal_state);
 	if ((mutex->owner_thread == thread) && (mutex->dh.signal_state <= 0)) {
@@ -1288,7 +2073,7 @@ wstdcall LONG WIN_FUNC(KeReleaseMutex,2)
 	}
 	EVENTTRACE("%p, %p, %p, %d", mutex, thread, mutex->owner_thread,
 		   mutex->dh.signal_state);
-	spin_unlock_bh(&dispatcher_lock);
+	spin_unlock_irqrestore(lock, flags);
 	EVENTEXIT(return ret);
 }
 
@@ -1310,9 +2095,12 @@ wstdcall LONG WIN_FUNC(KeReleaseSemaphore,4)
 	 BOOLEAN wait)
 {
 	LONG ret;
+	spinlock_t *lock;
+	unsigned long flags;
 
 	EVENTENTER("%p", semaphore);
-	spin_lock_bh(&dispatcher_lock);
+	lock = dispatcher_lock(&semaphore->dh);
+	spin_lock_irqsave(lock, flags);
 	ret = semaphore->dh.signal_state;
 	assert(ret >= 0);
 	if (semaphore->dh.signal_state + adjustment <= semaphore->limit)
@@ -1324,7 +2112,7 @@ wstdcall LONG WIN_FUNC(KeReleaseSemaphore,4)
 	}
 	if (semaphore->dh.signal_state > 0)
 		object_signaled(&semaphore->dh);
-	spin_unlock_bh(&dispatcher_lock);
+	spin_unlock_irqrestore(lock, flags);
 	EVENTEXIT(return ret);
 }
 
@@ -1358,7 +2146,7 @@ wstdcall NTSTATUS WIN_FUNC(KeDelayExecutionThread,3)
 wstdcall ULONGLONG WIN_FUNC(KeQueryInterruptTime,0)
 	(void)
 {
-	EXIT5(return jiffies * TICKSPERJIFFY);
+	EXIT5(return interrupt_ticks());
 }
 
 wstdcall ULONG WIN_FUNC(KeQueryTimeIncrement,0)
@@ -1384,8 +2172,8 @@ wstdcall LARGE_INTEGER WIN_FUNC(KeQueryPerformanceCounter,1)
 	(LARGE_INTEGER *counter)
 {
 	if (counter)
-		*counter = HZ;
-	return jiffies;
+		*counter = TICKSPERSEC;
+	return interrupt_ticks();
 }
 
 wstdcall KAFFINITY WIN_FUNC(KeQueryActiveProcessors,0)
@@ -1402,24 +2190,21 @@ wstdcall KAFFINITY WIN_FUNC(KeQueryActiveProcessors,0)
 struct nt_thread *get_current_nt_thread(void)
 {
 	struct task_struct *task = current;
-	struct nt_thread *thread;
+	struct nt_thread *thread, *cur;
 	struct common_object_header *header;
 
 	TRACE6("task: %p", task);
 	thread = NULL;
-	spin_lock_bh(&ntoskernel_lock);
-	nt_list_for_each_entry(header, &object_list, list) {
-		TRACE6("%p, %d", header, header->type);
-		if (header->type != OBJECT_TYPE_NT_THREAD)
-			break;
-		thread = HEADER_TO_OBJECT(header);
-		TRACE6("%p, %p", thread, thread->task);
-		if (thread->task == task)
+	rcu_read_lock();
+	list_for_each_entry_rcu(header, nt_thread_bucket(task), hash_list) {
+		cur = HEADER_TO_OBJECT(header);
+		TRACE6("%p, %p", cur, cur->task);
+		if (cur->task == task) {
+			thread = cur;
 			break;
-		else
-			thread = NULL;
+		}
 	}
-	spin_unlock_bh(&ntoskernel_lock);
+	rcu_read_unlock();
 	if (thread == NULL)
 		TRACE4("couldn't find thread for task %p, %d", task, task->pid);
 	TRACE6("%p", thread);
@@ -1430,25 +2215,46 @@ static struct task_struct *get_nt_thread_task(struct nt_thread *thread)
 {
 	struct task_struct *task;
 	struct common_object_header *header;
+	int i;
 
 	TRACE6("%p", thread);
+	/* thread may be an invalid pointer, so it can't be
+	 * dereferenced until it is found in thread table; this is
+	 * used rarely, so all buckets are searched */
 	task = NULL;
-	spin_lock_bh(&ntoskernel_lock);
-	nt_list_for_each_entry(header, &object_list, list) {
-		TRACE6("%p, %d", header, header->type);
-		if (header->type != OBJECT_TYPE_NT_THREAD)
-			break;
-		if (thread == HEADER_TO_OBJECT(header)) {
-			task = thread->task;
-			break;
+	rcu_read_lock();
+	for (i = 0; i < ARRAY_SIZE(object_tables[OBJECT_TYPE_NT_THREAD]) &&
+		     !task; i++) {
+		list_for_each_entry_rcu(header,
+					&object_tables[OBJECT_TYPE_NT_THREAD][i],
+					hash_list) {
+			if (thread == HEADER_TO_OBJECT(header)) {
+				task = thread->task;
+				break;
+			}
 		}
 	}
-	spin_unlock_bh(&ntoskernel_lock);
+	rcu_read_unlock();
 	if (task == NULL)
 		TRACE2("%p: couldn't find task for %p", current, thread);
 	return task;
 }
 
+static void set_nt_thread_task(struct nt_thread *thread,
+			       struct task_struct *task)
+{
+	struct common_object_header *hdr = OBJECT_TO_HEADER(thread);
+
+	thread->task = task;
+	thread->pid = task->pid;
+	spin_lock_bh(&ntoskernel_lock);
+	if (!hdr->hashed) {
+		list_add_rcu(&hdr->hash_list, nt_thread_bucket(task));
+		hdr->hashed = TRUE;
+	}
+	spin_unlock_bh(&ntoskernel_lock);
+}
+
 static struct nt_thread *create_nt_thread(struct task_struct *task)
 {
 	struct nt_thread *thread;
@@ -1457,11 +2263,12 @@ static struct nt_thread *create_nt_thread(struct task_struct *task)
 		ERROR("couldn't allocate thread object");
 		EXIT2(return NULL);
 	}
-	thread->task = task;
 	if (task)
-		thread->pid = task->pid;
-	else
+		set_nt_thread_task(thread, task);
+	else {
+		thread->task = NULL;
 		thread->pid = 0;
+	}
 	nt_spin_lock_init(&thread->lock);
 	InitializeListHead(&thread->irps);
 	initialize_object(&thread->dh, ThreadObject, 0);
@@ -1549,8 +2356,7 @@ static int ntdriver_thread(void *data)
 	typeof(thread_tramp->func) func = thread_tramp->func;
 	typeof(thread_tramp->ctx) ctx = thread_tramp->ctx;
 
-	thread_tramp->thread->task = current;
-	thread_tramp->thread->pid = current->pid;
+	set_nt_thread_task(thread_tramp->thread, current);
 	TRACE2("thread: %p, task: %p (%d)", thread_tramp->thread,
 	       current, current->pid);
 	complete(&thread_tramp->started);
@@ -1570,6 +2376,7 @@ wstdcall NTSTATUS WIN_FUNC(PsCreateSystemThread,7)
 	 void *client_id, void (*func)(void *) wstdcall, void *ctx)
 {
 	struct thread_trampoline thread_tramp;
+	struct task_struct *task;
 
 	ENTER2("handle = %p, access = %u, obj_attr = %p, process = %p, "
 	       "client_id = %p, func = %p, context = %p", handle, access,
@@ -1585,13 +2392,14 @@ wstdcall NTSTATUS WIN_FUNC(PsCreateSystemThread,7)
 	thread_tramp.ctx = ctx;
 	init_completion(&thread_tramp.started);
 
-	thread_tramp.thread->task = kthread_run(ntdriver_thread,
-						&thread_tramp, "ntdriver");
-	if (IS_ERR(thread_tramp.thread->task)) {
+	/* ntdriver_thread sets thread's task, so it can be found
+	 * before this returns */
+	task = kthread_run(ntdriver_thread, &thread_tramp, "ntdriver");
+	if (IS_ERR(task)) {
 		free_object(thread_tramp.thread);
 		EXIT2(return STATUS_FAILURE);
 	}
-	TRACE2("created task: %p", thread_tramp.thread->task);
+	TRACE2("created task: %p", task);
 
 	wait_for_completion(&thread_tramp.started);
 	*handle = OBJECT_TO_HEADER(thread_tramp.thread);
@@ -1779,9 +2587,9 @@ struct mdl *allocate_init_mdl(void *virt, ULONG length)
 		wrap_mdl = kmem_cache_alloc(mdl_cache, irql_gfp());
 		if (!wrap_mdl)
 			return NULL;
-		spin_lock_bh(&dispatcher_lock);
+		spin_lock_bh(&wrap_mdl_lock);
 		InsertHeadList(&wrap_mdl_list, &wrap_mdl->list);
-		spin_unlock_bh(&dispatcher_lock);
+		spin_unlock_bh(&wrap_mdl_lock);
 		mdl = wrap_mdl->mdl;
 		TRACE3("allocated mdl from cache: %p(%p), %p(%d)",
 		       wrap_mdl, mdl, virt, length);
@@ -1798,9 +2606,9 @@ struct mdl *allocate_init_mdl(void *virt, ULONG length)
 		mdl = wrap_mdl->mdl;
 		TRACE3("allocated mdl from memory: %p(%p), %p(%d)",
 		       wrap_mdl, mdl, virt, length);
-		spin_lock_bh(&dispatcher_lock);
+		spin_lock_bh(&wrap_mdl_lock);
 		InsertHeadList(&wrap_mdl_list, &wrap_mdl->list);
-		spin_unlock_bh(&dispatcher_lock);
+		spin_unlock_bh(&wrap_mdl_lock);
 		memset(mdl, 0, mdl_size);
 		MmInitializeMdl(mdl, virt, length);
 		mdl->flags = MDL_ALLOCATED_FIXED_SIZE;
@@ -1822,9 +2630,9 @@ void free_mdl(struct mdl *mdl)
 	else {
 		struct wrap_mdl *wrap_mdl = (struct wrap_mdl *)
 			((char *)mdl - offsetof(struct wrap_mdl, mdl));
-		spin_lock_bh(&dispatcher_lock);
+		spin_lock_bh(&wrap_mdl_lock);
 		RemoveEntryList(&wrap_mdl->list);
-		spin_unlock_bh(&dispatcher_lock);
+		spin_unlock_bh(&wrap_mdl_lock);
 
 		if (mdl->flags & MDL_CACHE_ALLOCATED) {
 			TRACE3("freeing mdl cache: %p, %p, %p",
@@ -2001,23 +2809,15 @@ wstdcall NTSTATUS WIN_FUNC(ZwCreateFile,11)
 	char *file_basename;
 	NTSTATUS status;
 
-	spin_lock_bh(&ntoskernel_lock);
-	nt_list_for_each_entry(coh, &object_list, list) {
-		if (coh->type != OBJECT_TYPE_FILE)
-			continue;
-		/* TODO: check if file is opened in shared mode */
-		if (!RtlCompareUnicodeString(&coh->name, obj_attr->name, TRUE)) {
-			fo = HEADER_TO_OBJECT(coh);
-			bin_file = fo->wrap_bin_file;
-			*handle = coh;
-			spin_unlock_bh(&ntoskernel_lock);
-			ObReferenceObject(fo);
-			iosb->status = FILE_OPENED;
-			iosb->info = bin_file->size;
-			EXIT2(return STATUS_SUCCESS);
-		}
+	/* TODO: check if file is opened in shared mode */
+	fo = lookup_named_object(OBJECT_TYPE_FILE, obj_attr->name);
+	if (fo) {
+		bin_file = fo->wrap_bin_file;
+		*handle = OBJECT_TO_HEADER(fo);
+		iosb->status = FILE_OPENED;
+		iosb->info = bin_file->size;
+		EXIT2(return STATUS_SUCCESS);
 	}
-	spin_unlock_bh(&ntoskernel_lock);
 
 	if (RtlUnicodeStringToAnsiString(&ansi, obj_attr->name, TRUE) !=
 	    STATUS_SUCCESS)
@@ -2485,35 +3285,67 @@ struct worker_init_struct {
 
 int ntoskernel_init(void)
 {
+#if LINUX_VERSION_CODE < KERNEL_VERSION(2,6,16)
 	struct timeval now;
+#endif
+	int i;
 
-	spin_lock_init(&dispatcher_lock);
+	for (i = 0; i < ARRAY_SIZE(dispatcher_locks); i++)
+		spin_lock_init(&dispatcher_locks[i]);
+	spin_lock_init(&dispatcher_nest_lock);
+	spin_lock_init(&wrap_mdl_lock);
 	spin_lock_init(&ntoskernel_lock);
 	spin_lock_init(&ntos_work_lock);
-	spin_lock_init(&kdpc_list_lock);
 	spin_lock_init(&irp_cancel_lock);
+#ifdef CONFIG_SMP
+	InitializeListHead(&nt_spin_lock_overflow);
+	spin_lock_init(&nt_spin_lock_overflow_lock);
+#endif
 	InitializeListHead(&wrap_mdl_list);
-	InitializeListHead(&kdpc_list);
 	InitializeListHead(&callback_objects);
+	InitializeListHead(&lookaside_lists);
+	spin_lock_init(&lookaside_lock);
+	init_timer(&lookaside_timer);
+	lookaside_timer.function = lookaside_timer_proc;
+	lookaside_timer.data = 0;
 	InitializeListHead(&bus_driver_list);
 	InitializeListHead(&object_list);
+	for (i = 0; i < OBJECT_TYPE_MAX; i++) {
+		int j;
+		for (j = 0; j < ARRAY_SIZE(object_tables[i]); j++)
+			INIT_LIST_HEAD(&object_tables[i][j]);
+	}
 	InitializeListHead(&ntos_work_list);
 
 	nt_spin_lock_init(&nt_list_lock);
 
-	INIT_WORK(&kdpc_work, kdpc_worker);
 	INIT_WORK(&ntos_work, ntos_work_worker);
-	wrap_timer_slist.next = NULL;
+	wrap_timer_table_init(&ntos_timer_table);
 
+#if LINUX_VERSION_CODE < KERNEL_VERSION(2,6,16)
 	do_gettimeofday(&now);
 	wrap_ticks_to_boot = TICKS_1601_TO_1970;
 	wrap_ticks_to_boot += (u64)now.tv_sec * TICKSPERSEC;
 	wrap_ticks_to_boot += now.tv_usec * 10;
 	wrap_ticks_to_boot -= jiffies * TICKSPERJIFFY;
 	TRACE2("%llu", wrap_ticks_to_boot);
+#endif
 
 	cpu_count = num_online_cpus();
 
+	do {
+		int cpu;
+		for_each_possible_cpu(cpu) {
+			struct kdpc_queue *queue = &per_cpu(kdpc_queues, cpu);
+			InitializeListHead(&queue->list);
+			spin_lock_init(&queue->lock);
+			INIT_WORK(&queue->work, kdpc_worker);
+			tasklet_init(&queue->tasklet, kdpc_tasklet_func,
+				     (unsigned long)queue);
+			queue->cpu = cpu;
+		}
+	} while (0);
+
 #ifdef WRAP_PREEMPT
 	do {
 		int cpu;
@@ -2537,6 +3369,14 @@ int ntoskernel_init(void)
 	}
 	TRACE1("ntos_wq: %p", ntos_wq);
 
+	kdpc_wq = create_workqueue("kdpc_wq");
+	if (!kdpc_wq) {
+		WARNING("couldn't create kdpc_wq threads");
+		ntoskernel_exit();
+		return -ENOMEM;
+	}
+	TRACE1("kdpc_wq: %p", kdpc_wq);
+
 	if (add_bus_driver("PCI")
 #ifdef ENABLE_USB
 	    || add_bus_driver("USB")
@@ -2555,10 +3395,21 @@ int ntoskernel_init(void)
 		ntoskernel_exit();
 		return -ENOMEM;
 	}
+	wrap_timer_cache =
+		wrap_kmem_cache_create(DRIVER_NAME "_timer",
+				       sizeof(struct wrap_timer), 0, 0);
+	if (!wrap_timer_cache) {
+		ERROR("couldn't allocate timer cache");
+		ntoskernel_exit();
+		return -ENOMEM;
+	}
 
 #if defined(CONFIG_X86_64)
 	memset(&kuser_shared_data, 0, sizeof(kuser_shared_data));
-	*((ULONG64 *)&kuser_shared_data.system_time) = ticks_1601();
+	/* tick_count * tick_count_multiplier >> 24 gives milliseconds */
+	kuser_shared_data.tick_count_multiplier =
+		((u64)(TICKSPERSEC / HZ) << 24) / TICKSPERMSEC;
+	update_user_shared_data();
 	init_timer(&shared_data_timer);
 	shared_data_timer.function = update_user_shared_data_proc;
 	shared_data_timer.data = 0;
@@ -2591,28 +3442,15 @@ void ntoskernel_exit(void)
 
 	/* free kernel (Ke) timers */
 	TRACE2("freeing timers");
-	while (1) {
-		struct wrap_timer *wrap_timer;
-		struct nt_slist *slist;
-
-		spin_lock_bh(&ntoskernel_lock);
-		if ((slist = wrap_timer_slist.next))
-			wrap_timer_slist.next = slist->next;
-		spin_unlock_bh(&ntoskernel_lock);
-		TIMERTRACE("%p", slist);
-		if (!slist)
-			break;
-		wrap_timer = container_of(slist, struct wrap_timer, slist);
-		if (del_timer_sync(&wrap_timer->timer))
-			WARNING("Buggy Windows driver left timer %p running",
-				wrap_timer->nt_timer);
-		memset(wrap_timer, 0, sizeof(*wrap_timer));
-		slack_kfree(wrap_timer);
+	if (wrap_timer_cache) {
+		free_wrap_timers(&ntos_timer_table);
+		kmem_cache_destroy(wrap_timer_cache);
+		wrap_timer_cache = NULL;
 	}
 
 	TRACE2("freeing MDLs");
 	if (mdl_cache) {
-		spin_lock_bh(&ntoskernel_lock);
+		spin_lock_bh(&wrap_mdl_lock);
 		if (!IsListEmpty(&wrap_mdl_list))
 			ERROR("Windows driver didn't free all MDLs; "
 			      "freeing them now");
@@ -2624,7 +3462,7 @@ void ntoskernel_exit(void)
 			else
 				kfree(wrap_mdl);
 		}
-		spin_unlock_bh(&ntoskernel_lock);
+		spin_unlock_bh(&wrap_mdl_lock);
 		kmem_cache_destroy(mdl_cache);
 		mdl_cache = NULL;
 	}
@@ -2656,6 +3494,20 @@ void ntoskernel_exit(void)
 #if defined(CONFIG_X86_64)
 	del_timer_sync(&shared_data_timer);
 #endif
+	spin_lock_bh(&lookaside_lock);
+	if (!IsListEmpty(&lookaside_lists))
+		WARNING("Windows driver didn't delete all lookaside lists");
+	InitializeListHead(&lookaside_lists);
+	spin_unlock_bh(&lookaside_lock);
+	del_timer_sync(&lookaside_timer);
+	if (kdpc_wq) {
+		int cpu;
+		destroy_workqueue(kdpc_wq);
+		for_each_possible_cpu(cpu)
+			tasklet_kill(&per_cpu(kdpc_queues, cpu).tasklet);
+	}
+	/* objects freed with call_rcu may queue ntos work */
+	rcu_barrier();
 	if (ntos_wq)
 		destroy_workqueue(ntos_wq);
 	ENTER2("freeing objects");
@@ -2669,7 +3521,7 @@ void ntoskernel_exit(void)
 		else
 			WARNING("object %p(%d) was not freed, freeing it now",
 				HEADER_TO_OBJECT(hdr), hdr->type);
-		ExFreePool(hdr);
+		free_object_header(hdr);
 	}
 	spin_unlock_bh(&ntoskernel_lock);
 
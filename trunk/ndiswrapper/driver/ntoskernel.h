@@ -18,6 +18,7 @@
 
 #include <linux/types.h>
 #include <linux/timer.h>
+#include <linux/hrtimer.h>
 #include <linux/time.h>
 #include <linux/module.h>
 #include <linux/kmod.h>
@@ -32,10 +33,12 @@
 #include <linux/random.h>
 #include <linux/ctype.h>
 #include <linux/list.h>
+#include <linux/rcupdate.h>
 #include <linux/sched.h>
 #include <linux/usb.h>
 #include <linux/spinlock.h>
 #include <asm/mman.h>
+#include <asm/div64.h>
 #include <linux/version.h>
 #include <linux/etherdevice.h>
 #include <net/iw_handler.h>
@@ -91,6 +94,10 @@ static inline void *_kzalloc(size_t size, gfp_t flags)
 #define set_cpus_allowed_ptr(task, mask) set_cpus_allowed(task, *mask)
 #endif /* Linux < 2.6.26 */
 
+#ifndef spin_lock_nest_lock
+#define spin_lock_nest_lock(lock, nest_lock) spin_lock(lock)
+#endif
+
 #ifdef CONFIG_SMP
 #if LINUX_VERSION_CODE < KERNEL_VERSION(2,6,28)
 #define cpumask_copy(dst, src) do { *dst = *src; } while (0)
@@ -211,6 +218,8 @@ struct wrap_work_struct {
 #define destroy_workqueue(wq) wrap_destroy_wq(wq)
 #undef queue_work
 #define queue_work(wq, work) wrap_queue_work(wq, work)
+#undef queue_work_on
+#define queue_work_on(cpu, wq, work) wrap_queue_work_on(wq, work, cpu)
 #undef flush_workqueue
 #define flush_workqueue(wq) wrap_flush_wq(wq)
 
@@ -218,6 +227,8 @@ struct workqueue_struct *wrap_create_wq(const char *name, u8 singlethread,
 					u8 freeze);
 void wrap_destroy_wq(struct workqueue_struct *workq);
 int wrap_queue_work(struct workqueue_struct *workq, struct work_struct *work);
+int wrap_queue_work_on(struct workqueue_struct *workq,
+		       struct work_struct *work, int cpu);
 void wrap_cancel_work(struct work_struct *work);
 void wrap_flush_wq(struct workqueue_struct *workq);
 
@@ -236,6 +247,10 @@ static inline void (INIT_WORK)(struct work_struct *work, work_func_t func)
 #undef INIT_WORK
 #endif
 
+#if LINUX_VERSION_CODE < KERNEL_VERSION(2,6,28)
+#define queue_work_on(cpu, wq, work) queue_work(wq, work)
+#endif
+
 #endif // WRAP_WQ
 
 #if LINUX_VERSION_CODE > KERNEL_VERSION(2,6,18)
@@ -330,6 +345,15 @@ static inline void netif_poll_disable(struct net_device *dev)
 }
 #endif
 
+/* received packets are passed to stack with NAPI and GRO */
+#if LINUX_VERSION_CODE >= KERNEL_VERSION(2,6,29)
+#define WRAP_NAPI
+#endif
+
+#if LINUX_VERSION_CODE < KERNEL_VERSION(3,19,0)
+#define napi_complete_done(napi, work_done) napi_complete(napi)
+#endif
+
 #if LINUX_VERSION_CODE >= KERNEL_VERSION(2,6,24)
 #define proc_net_root init_net.proc_net
 #else
@@ -379,8 +403,34 @@ static inline void reinit_completion(struct completion *x)
 	 int_div_round(((s64)HZ * ((sys_time) - ticks_1601())), TICKSPERSEC))
 
 #define MSEC_TO_HZ(ms) int_div_round((ms * HZ), 1000)
+#define TICKS_TO_HZ(ticks) int_div_round(((u64)(ticks) * HZ), TICKSPERSEC)
 #define USEC_TO_HZ(us) int_div_round((us * HZ), 1000000)
 
+#if LINUX_VERSION_CODE >= KERNEL_VERSION(2,6,16)
+
+static inline u64 ktime_to_ticks(ktime_t kt)
+{
+	u64 ns = ktime_to_ns(kt);
+
+	do_div(ns, 100);
+	return ns;
+}
+
+/* 100ns units since year 1601 */
+static inline u64 ticks_1601(void)
+{
+	return TICKS_1601_TO_1970 + ktime_to_ticks(ktime_get_real());
+}
+
+/* 100ns units since boot; this is also the performance counter, with
+ * frequency TICKSPERSEC, as on Windows */
+static inline u64 interrupt_ticks(void)
+{
+	return ktime_to_ticks(ktime_get());
+}
+
+#else
+
 extern u64 wrap_ticks_to_boot;
 
 static inline u64 ticks_1601(void)
@@ -388,6 +438,25 @@ static inline u64 ticks_1601(void)
 	return wrap_ticks_to_boot + (u64)jiffies * TICKSPERJIFFY;
 }
 
+static inline u64 interrupt_ticks(void)
+{
+	return (u64)jiffies * TICKSPERJIFFY;
+}
+
+#endif
+
+/* 100ns units from now until due_time, which is relative to current
+ * clock if negative, otherwise from year 1601 */
+static inline u64 due_time_to_ticks(LONGLONG due_time)
+{
+	u64 now;
+
+	if (due_time <= 0)
+		return -due_time;
+	now = ticks_1601();
+	return (u64)due_time > now ? due_time - now : 0;
+}
+
 typedef void (*generic_func)(void);
 
 struct wrap_export {
@@ -434,16 +503,60 @@ struct pe_image {
 
 struct ndis_mp_block;
 
+/* timers are backed by hrtimers, unless WRAP_JIFFIES_TIMERS is
+ * defined; with hrtimers, 'repeat' is in ns, otherwise in jiffies */
+#if LINUX_VERSION_CODE >= KERNEL_VERSION(2,6,28) && \
+	!defined(WRAP_JIFFIES_TIMERS)
+#define WRAP_HRTIMER 1
+#endif
+
+/* default slack (in ns) of timers; hrtimer may expire that much later
+ * so it can be coalesced with other timers */
+#define WRAP_TIMER_SLACK 50000
+
+#define WRAP_TIMER_HASH_BITS 4
+
+/* wrap_timers of a device, or of Ke timers that are not associated
+ * with any device, hashed by address of nt_timer */
+struct wrap_timer_table {
+	spinlock_t lock;
+	unsigned int count;
+	struct nt_list buckets[1 << WRAP_TIMER_HASH_BITS];
+};
+
 struct wrap_timer {
-	struct nt_slist slist;
+	struct nt_list list;
+#ifdef WRAP_HRTIMER
+	struct hrtimer timer;
+	u64 repeat;
+#else
 	struct timer_list timer;
-	struct nt_timer *nt_timer;
 	long repeat;
+#endif
+	unsigned long slack;
+	struct nt_timer *nt_timer;
+	/* statistics: period in 100ns units, DPC runtime in ns */
+	u64 period;
+	unsigned long fired;
+	u64 dpc_time;
 #ifdef TIMER_DEBUG
 	unsigned long wrap_timer_magic;
 #endif
 };
 
+extern struct wrap_timer_table ntos_timer_table;
+
+/* returns 1 if timer was pending; waits for timer function to
+ * finish */
+static inline int cancel_wrap_timer(struct wrap_timer *wrap_timer)
+{
+#ifdef WRAP_HRTIMER
+	return hrtimer_cancel(&wrap_timer->timer);
+#else
+	return del_timer_sync(&wrap_timer->timer);
+#endif
+}
+
 struct ntos_work_item {
 	struct nt_list list;
 	void *arg1;
@@ -484,6 +597,10 @@ enum hw_status {
 	HW_INITIALIZED = 1, HW_SUSPENDED, HW_HALTED, HW_DISABLED,
 };
 
+struct wrap_urb_complete_queue;
+struct wrap_dma_buf_cache;
+struct wrap_readahead;
+
 struct wrap_device {
 	/* first part is (de)initialized once by loader */
 	struct nt_list list;
@@ -511,7 +628,16 @@ struct wrap_device {
 			struct usb_device *udev;
 			struct usb_interface *intf;
 			int num_alloc_urbs;
+			int max_alloc_urbs;
 			struct nt_list wrap_urb_list;
+			/* stack of free urbs */
+			struct nt_list free_urbs;
+			spinlock_t free_urbs_lock;
+			struct wrap_urb_complete_queue *complete_queues;
+			struct wrap_dma_buf_cache *dma_bufs;
+			/* bulk-in read-ahead, indexed by endpoint number */
+			int readahead_depth;
+			struct wrap_readahead *readahead;
 		} usb;
 	};
 };
@@ -628,6 +754,11 @@ static inline KIRQL raise_irql(KIRQL newirql)
 	struct irql_info *info;
 
 	assert(newirql == DISPATCH_LEVEL);
+	/* in interrupt context (e.g., when DPCs are run from tasklet)
+	 * IRQL is already above DISPATCH_LEVEL and we can't sleep on
+	 * the mutex */
+	if (in_interrupt() || irqs_disabled())
+		return DISPATCH_LEVEL;
 	info = &get_cpu_var(irql_info);
 	if (info->task == current) {
 		assert(info->count > 0);
@@ -660,6 +791,8 @@ static inline void lower_irql(KIRQL oldirql)
 	struct irql_info *info;
 
 	assert(oldirql <= DISPATCH_LEVEL);
+	if (in_interrupt() || irqs_disabled())
+		return;
 	info = &get_cpu_var(irql_info);
 	assert(info->task == current);
 	assert(mutex_is_locked(&info->lock));
@@ -730,8 +863,13 @@ static inline void lower_irql(KIRQL oldirql)
  * convention of 1 for unlocked state is used, at least prism54 driver
  * crashes */
 
+/* spinlocks are MCS (queued) locks: while locked, a spinlock holds
+ * address of kspin_lock_queue of the last processor in its queue;
+ * each waiter spins on its own queue entry and is handed the lock in
+ * FIFO order. In-stack queued spinlocks use the caller's entry; for
+ * other spinlocks an entry is taken from a per-processor table. */
+
 #define NT_SPIN_LOCK_UNLOCKED 0
-#define NT_SPIN_LOCK_LOCKED 1
 
 static inline void nt_spin_lock_init(NT_SPIN_LOCK *lock)
 {
@@ -740,30 +878,33 @@ static inline void nt_spin_lock_init(NT_SPIN_LOCK *lock)
 
 #ifdef CONFIG_SMP
 
-static inline void nt_spin_lock(NT_SPIN_LOCK *lock)
-{
-	while (1) {
-		unsigned long lockval = xchg(lock, NT_SPIN_LOCK_LOCKED);
+void nt_queued_spin_lock(NT_SPIN_LOCK *lock, struct kspin_lock_queue *queue,
+			 void *site);
+void nt_queued_spin_unlock(NT_SPIN_LOCK *lock,
+			   struct kspin_lock_queue *queue);
 
-		if (likely(lockval == NT_SPIN_LOCK_UNLOCKED))
-			break;
-		if (unlikely(lockval > NT_SPIN_LOCK_LOCKED)) {
-			ERROR("bad spinlock: 0x%lx at %p", lockval, lock);
-			return;
-		}
-		/* "rep; nop" doesn't change cx register, it's a "pause" */
-		__asm__ __volatile__("rep; nop");
-	}
-}
+/* contention is accounted to the caller of the function taking the
+ * lock, which for exported functions is the Windows driver */
+#define nt_spin_lock(lock)							\
+	nt_queued_spin_lock(lock, NULL, __builtin_return_address(0))
 
-static inline void nt_spin_unlock(NT_SPIN_LOCK *lock)
-{
-	unsigned long lockval = xchg(lock, NT_SPIN_LOCK_UNLOCKED);
+#define nt_spin_unlock(lock) nt_queued_spin_unlock(lock, NULL)
 
-	if (likely(lockval == NT_SPIN_LOCK_LOCKED))
-		return;
-	WARNING("unlocking unlocked spinlock: 0x%lx at %p", lockval, lock);
-}
+#define nt_spin_lock_queued(lock, queue)				\
+	nt_queued_spin_lock(lock, queue, __builtin_return_address(0))
+
+#define nt_spin_unlock_queued(lock, queue)				\
+	nt_queued_spin_unlock(lock, queue)
+
+#define NT_SPIN_LOCK_SITE_BITS 8
+
+struct nt_spin_lock_site {
+	void *site;
+	atomic_t contended;
+	atomic_long_t spins;
+};
+
+extern struct nt_spin_lock_site nt_spin_lock_sites[];
 
 #else // CONFIG_SMP
 
@@ -771,6 +912,10 @@ static inline void nt_spin_unlock(NT_SPIN_LOCK *lock)
 
 #define nt_spin_unlock(lock) do { } while (0)
 
+#define nt_spin_lock_queued(lock, queue) do { } while (0)
+
+#define nt_spin_unlock_queued(lock, queue) do { } while (0)
+
 #endif // CONFIG_SMP
 
 /* When kernel would've disabled preempt (e.g., in interrupt
@@ -814,32 +959,96 @@ static inline ULONG SPAN_PAGES(void *ptr, SIZE_T length)
 
 #ifdef CONFIG_X86_64
 
-/* TODO: can these be implemented without using spinlock? */
+/* 'align' field keeps depth in low 16 bits and a sequence number in
+ * the rest; the sequence number is bumped on every update so that a
+ * pop racing with pop/push of the same entry (ABA) is caught by
+ * cmpxchg16b */
+#define NT_SLIST_DEPTH_MASK 0xffffULL
+#define NT_SLIST_SEQUENCE_INC (NT_SLIST_DEPTH_MASK + 1)
+
+static inline int nt_cmpxchg16b(nt_slist_header *head, nt_slist_header *old,
+				nt_slist_header *new)
+{
+	u8 ret;
+
+	__asm__ __volatile__(
+		"\n"
+		LOCK_PREFIX "cmpxchg16b %1\n"
+		"sete %0\n"
+		: "=q" (ret), "+m" (*head), "+a" (old->align),
+		  "+d" (old->region)
+		: "b" (new->align), "c" (new->region)
+		: "memory");
+	return ret;
+}
+
+/* cmpxchg16b needs the header to be 16-byte aligned; headers
+ * declared by drivers are, but fall back to spinlock if not (or if
+ * processor doesn't support cmpxchg16b) */
+static inline bool nt_slist_lockfree(nt_slist_header *head)
+{
+	return boot_cpu_has(X86_FEATURE_CX16) &&
+		!((unsigned long)head & (sizeof(*head) - 1));
+}
 
 static inline struct nt_slist *PushEntrySList(nt_slist_header *head,
 					      struct nt_slist *entry,
 					      NT_SPIN_LOCK *lock)
 {
-	KIRQL irql = nt_spin_lock_irql(lock, DISPATCH_LEVEL);
-	entry->next = head->next;
-	head->next = entry;
-	head->depth++;
-	nt_spin_unlock_irql(lock, irql);
-	TRACE4("%p, %p, %p", head, entry, entry->next);
-	return entry->next;
+	nt_slist_header old, new;
+
+	if (unlikely(!nt_slist_lockfree(head))) {
+		unsigned long flags;
+		nt_spin_lock_irqsave(lock, flags);
+		entry->next = head->next;
+		head->next = entry;
+		head->depth++;
+		nt_spin_unlock_irqrestore(lock, flags);
+		TRACE4("%p, %p, %p", head, entry, entry->next);
+		return entry->next;
+	}
+	old.align = ACCESS_ONCE(head->align);
+	old.region = ACCESS_ONCE(head->region);
+	do {
+		entry->next = old.next;
+		new.next = entry;
+		new.align = ((old.align + NT_SLIST_SEQUENCE_INC) &
+			     ~NT_SLIST_DEPTH_MASK) |
+			(USHORT)(old.depth + 1);
+	} while (!nt_cmpxchg16b(head, &old, &new));
+	TRACE4("%p, %p, %p", head, entry, old.next);
+	return old.next;
 }
 
 static inline struct nt_slist *PopEntrySList(nt_slist_header *head,
 					     NT_SPIN_LOCK *lock)
 {
 	struct nt_slist *entry;
-	KIRQL irql = nt_spin_lock_irql(lock, DISPATCH_LEVEL);
-	entry = head->next;
-	if (entry) {
-		head->next = entry->next;
-		head->depth--;
+	nt_slist_header old, new;
+
+	if (unlikely(!nt_slist_lockfree(head))) {
+		unsigned long flags;
+		nt_spin_lock_irqsave(lock, flags);
+		entry = head->next;
+		if (entry) {
+			head->next = entry->next;
+			head->depth--;
+		}
+		nt_spin_unlock_irqrestore(lock, flags);
+		TRACE4("%p, %p", head, entry);
+		return entry;
 	}
-	nt_spin_unlock_irql(lock, irql);
+	old.align = ACCESS_ONCE(head->align);
+	old.region = ACCESS_ONCE(head->region);
+	do {
+		entry = old.next;
+		if (!entry)
+			break;
+		new.next = entry->next;
+		new.align = ((old.align + NT_SLIST_SEQUENCE_INC) &
+			     ~NT_SLIST_DEPTH_MASK) |
+			(USHORT)(old.depth - 1);
+	} while (!nt_cmpxchg16b(head, &old, &new));
 	TRACE4("%p, %p", head, entry);
 	return entry;
 }
@@ -874,6 +1083,7 @@ static inline struct nt_slist *PushEntrySList(nt_slist_header *head,
 		entry->next = old.next;
 		new.next = entry;
 		new.depth = old.depth + 1;
+		new.sequence = old.sequence + 1;
 	} while (nt_cmpxchg8b(&head->align, old.align, new.align) != old.align);
 	TRACE4("%p, %p, %p", head, entry, old.next);
 	return old.next;
@@ -891,6 +1101,7 @@ static inline struct nt_slist *PopEntrySList(nt_slist_header *head,
 			break;
 		new.next = entry->next;
 		new.depth = old.depth - 1;
+		new.sequence = old.sequence + 1;
 	} while (nt_cmpxchg8b(&head->align, old.align, new.align) != old.align);
 	TRACE4("%p, %p", head, entry);
 	return entry;
@@ -910,6 +1121,8 @@ int ntoskernel_init_device(struct wrap_device *wd);
 void ntoskernel_exit_device(struct wrap_device *wd);
 void *allocate_object(ULONG size, enum common_object_type type,
 		      struct unicode_string *name);
+void *lookup_named_object(enum common_object_type type,
+			  const struct unicode_string *name);
 
 #ifdef ENABLE_USB
 int usb_init(void);
@@ -928,6 +1141,12 @@ int link_pe_images(struct pe_image *pe_image, unsigned short n);
 
 int stricmp(const char *s1, const char *s2);
 void dump_bytes(const char *name, const u8 *from, int len);
+/* MDLs that map at most MDL_CACHE_PAGES pages are allocated from
+ * (and freed to) a kmem_cache */
+#define MDL_CACHE_PAGES 3
+#define MDL_CACHE_SIZE (sizeof(struct mdl) + \
+			(sizeof(PFN_NUMBER) * MDL_CACHE_PAGES))
+
 struct mdl *allocate_init_mdl(void *virt, ULONG length);
 void free_mdl(struct mdl *mdl);
 struct driver_object *find_bus_driver(const char *name);
@@ -937,8 +1156,10 @@ u64 ticks_1601(void);
 int schedule_ntos_work_item(NTOS_WORK_FUNC func, void *arg1, void *arg2);
 void wrap_init_timer(struct nt_timer *nt_timer, enum timer_type type,
 		     struct ndis_mp_block *nmb);
-BOOLEAN wrap_set_timer(struct nt_timer *nt_timer, unsigned long expires_hz,
-		       unsigned long repeat_hz, struct kdpc *kdpc);
+void wrap_timer_table_init(struct wrap_timer_table *table);
+void free_wrap_timers(struct wrap_timer_table *table);
+BOOLEAN wrap_set_timer(struct nt_timer *nt_timer, u64 expires, u64 repeat,
+		       struct kdpc *kdpc);
 
 LONG InterlockedDecrement(LONG volatile *val) wfastcall;
 LONG InterlockedIncrement(LONG volatile *val) wfastcall;
@@ -1059,7 +1280,6 @@ void KeInitializeDpc(struct kdpc *kdpc, void *func, void *ctx) wstdcall;
 
 extern spinlock_t ntoskernel_lock;
 extern spinlock_t irp_cancel_lock;
-extern struct nt_list object_list;
 extern CCHAR cpu_count;
 #ifdef CONFIG_X86_64
 extern struct kuser_shared_data kuser_shared_data;
@@ -290,13 +290,12 @@ wstdcall struct irp *WIN_FUNC(IoBuildDeviceIoControlRequest,9)
 				IoFreeIrp(irp);
 				IOEXIT(return NULL);
 			}
-			irp->associated_irp.system_buffer = input_buf;
 			if (input_buf)
 				memcpy(irp->associated_irp.system_buffer,
 				       input_buf, input_buf_len);
 			irp->flags = IRP_BUFFERED_IO | IRP_DEALLOCATE_BUFFER;
 			if (output_buf)
-				irp->flags = IRP_INPUT_OPERATION;
+				irp->flags |= IRP_INPUT_OPERATION;
 			irp->user_buf = output_buf;
 		} else
 			irp->user_buf = NULL;
@@ -947,23 +946,11 @@ wstdcall NTSTATUS WIN_FUNC(IoGetDeviceObjectPointer,4)
 	(struct unicode_string *name, ACCESS_MASK desired_access,
 	 struct file_object *file_obj, struct device_object *dev_obj)
 {
-	struct common_object_header *coh;
-
-	dev_obj = NULL;
 	/* TODO: access is not checked and file_obj is filled with zeroes */
-	spin_lock_bh(&ntoskernel_lock);
-	nt_list_for_each_entry(coh, &object_list, list) {
-		TRACE5("header: %p, type: %d", coh, coh->type);
-		if (coh->type != OBJECT_TYPE_DEVICE)
-			continue;
-		if (!RtlCompareUnicodeString(&coh->name, name, TRUE)) {
-			dev_obj = HEADER_TO_OBJECT(coh);
-			TRACE5("dev_obj: %p", dev_obj);
-			break;
-		}
-	}
-	spin_unlock_bh(&ntoskernel_lock);
+	dev_obj = lookup_named_object(OBJECT_TYPE_DEVICE, name);
+	TRACE5("dev_obj: %p", dev_obj);
 	if (dev_obj) {
+		ObDereferenceObject(dev_obj);
 		memset(file_obj, 0, sizeof(*file_obj));
 		WARNING("file_obj filled with zeroes");
 		IOEXIT(return STATUS_SUCCESS);
@@ -22,6 +22,9 @@
 #include "wrapndis.h"
 #include "pnp.h"
 #include "wrapper.h"
+#ifdef ENABLE_USB
+#include "usb.h"
+#endif
 
 #define MAX_PROC_STR_LEN 32
 
@@ -326,6 +329,9 @@ static int proc_settings_read(struct seq_file *sf, void *v)
 
 	add_text("hangcheck_interval=%d\n", (hangcheck_interval == 0) ?
 		 (wnd->hangcheck_interval / HZ) : -1);
+	add_text("tx_ring_size=%u\n", wnd->tx_ring_size);
+	add_text("tx_direct=%d\n", wnd->tx_direct);
+	add_text("timer_slack_us=%lu\n", wnd->timer_slack / NSEC_PER_USEC);
 
 	list_for_each_entry(setting, &wnd->wd->settings, list) {
 		add_text("%s=%s\n", setting->name, setting->value);
@@ -369,6 +375,35 @@ static ssize_t proc_settings_write(struct file *file, const char __user *buf,
 			wnd->hangcheck_interval = i * HZ;
 			hangcheck_add(wnd);
 		}
+	} else if (!strcmp(setting, "tx_ring_size")) {
+		int ret;
+
+		if (!p)
+			return -EINVAL;
+		p++;
+		i = simple_strtol(p, NULL, 10);
+		if (i == 0 || i > MAX_TX_RING_SIZE)
+			return -EINVAL;
+		ret = set_tx_ring_size(wnd, i);
+		if (ret)
+			return ret;
+	} else if (!strcmp(setting, "tx_direct")) {
+		if (!p)
+			return -EINVAL;
+		p++;
+		i = simple_strtol(p, NULL, 10);
+		wnd->tx_direct = (i > 0) ? 1 : 0;
+	} else if (!strcmp(setting, "timer_slack_us")) {
+		long slack;
+		char *end;
+
+		if (!p)
+			return -EINVAL;
+		p++;
+		slack = simple_strtol(p, &end, 10);
+		if (end == p || *end || slack < 0)
+			return -EINVAL;
+		set_timer_slack(wnd, (unsigned long)slack * NSEC_PER_USEC);
 	} else if (!strcmp(setting, "suspend")) {
 		if (!p)
 			return -EINVAL;
@@ -443,6 +478,100 @@ static ssize_t proc_settings_write(struct file *file, const char __user *buf,
 
 PROC_DECLARE_RW(settings)
 
+static void show_wrap_timers(struct seq_file *sf,
+			     struct wrap_timer_table *table)
+{
+	struct wrap_timer *wrap_timer;
+	u64 period_us, dpc_us;
+	int i;
+
+	add_text("%-18s %10s %10s %12s\n", "timer", "period_us", "fired",
+		 "dpc_time_us");
+	spin_lock_bh(&table->lock);
+	for (i = 0; i < ARRAY_SIZE(table->buckets); i++) {
+		nt_list_for_each_entry(wrap_timer, &table->buckets[i], list) {
+			period_us = wrap_timer->period;
+			do_div(period_us, 10);
+			dpc_us = wrap_timer->dpc_time;
+			do_div(dpc_us, NSEC_PER_USEC);
+			add_text("%-18p %10llu %10lu %12llu\n",
+				 wrap_timer->nt_timer, period_us,
+				 wrap_timer->fired, dpc_us);
+		}
+	}
+	add_text("total: %u\n", table->count);
+	spin_unlock_bh(&table->lock);
+}
+
+static int proc_timers_read(struct seq_file *sf, void *v)
+{
+	struct ndis_device *wnd = (struct ndis_device *)sf->private;
+
+	show_wrap_timers(sf, wnd ? &wnd->timer_table : &ntos_timer_table);
+	return 0;
+}
+
+PROC_DECLARE_RO(timers)
+
+#ifdef ENABLE_USB
+static int proc_readahead_read(struct seq_file *sf, void *v)
+{
+	struct ndis_device *wnd = (struct ndis_device *)sf->private;
+	struct wrap_device *wd = wnd->wd;
+	struct wrap_readahead *ra;
+	unsigned long flags;
+	int i;
+
+	add_text("depth=%d\n", wd->usb.readahead_depth);
+	if (!wd->usb.readahead)
+		return 0;
+	add_text("%-4s %8s %8s %6s %9s %6s %10s %10s\n", "ep", "buf_size",
+		 "bufs", "ready", "submitted", "stop", "hits", "misses");
+	for (i = 0; i < READAHEAD_PIPES; i++) {
+		ra = &wd->usb.readahead[i];
+		spin_lock_irqsave(&ra->lock, flags);
+		if (ra->buf_size)
+			add_text("%-4d %8u %8d %6d %9d %6d %10lu %10lu\n", i,
+				 ra->buf_size, ra->num_bufs, ra->num_ready,
+				 ra->submitted, ra->stopped, ra->hits,
+				 ra->misses);
+		spin_unlock_irqrestore(&ra->lock, flags);
+	}
+	return 0;
+}
+
+static ssize_t proc_readahead_write(struct file *file,
+				    const char __user *buf,
+				    size_t count, loff_t *ppos)
+{
+	struct ndis_device *wnd = PDE_DATA(file_inode(file));
+	char setting[MAX_PROC_STR_LEN], *p;
+	int i;
+
+	if (count > MAX_PROC_STR_LEN)
+		return -EINVAL;
+
+	memset(setting, 0, sizeof(setting));
+	if (copy_from_user(setting, buf, count))
+		return -EFAULT;
+
+	if ((p = strchr(setting, '\n')))
+		*p = 0;
+
+	if ((p = strchr(setting, '=')))
+		p++;
+	else
+		p = setting;
+
+	i = simple_strtol(p, NULL, 10);
+	if (wrap_readahead_set_depth(wnd->wd, i))
+		return -EINVAL;
+	return count;
+}
+
+PROC_DECLARE_RW(readahead)
+#endif
+
 int wrap_procfs_add_ndis_device(struct ndis_device *wnd)
 {
 	int ret;
@@ -477,8 +606,26 @@ int wrap_procfs_add_ndis_device(struct ndis_device *wnd)
 	if (ret)
 		goto err_settings;
 
+	ret = proc_make_entry_ro(timers, wnd->procfs_iface, wnd);
+	if (ret)
+		goto err_timers;
+
+#ifdef ENABLE_USB
+	if (wrap_is_usb_bus(wnd->wd->dev_bus)) {
+		ret = proc_make_entry_rw(readahead, wnd->procfs_iface, wnd);
+		if (ret)
+			goto err_readahead;
+	}
+#endif
+
 	return 0;
 
+#ifdef ENABLE_USB
+err_readahead:
+	remove_proc_entry("timers", wnd->procfs_iface);
+#endif
+err_timers:
+	remove_proc_entry("settings", wnd->procfs_iface);
 err_settings:
 	remove_proc_entry("encr", wnd->procfs_iface);
 err_encr:
@@ -501,6 +648,11 @@ void wrap_procfs_remove_ndis_device(struct ndis_device *wnd)
 	remove_proc_entry("stats", procfs_iface);
 	remove_proc_entry("encr", procfs_iface);
 	remove_proc_entry("settings", procfs_iface);
+	remove_proc_entry("timers", procfs_iface);
+#ifdef ENABLE_USB
+	if (wrap_is_usb_bus(wnd->wd->dev_bus))
+		remove_proc_entry("readahead", procfs_iface);
+#endif
 	if (wrap_procfs_entry)
 		proc_remove(procfs_iface);
 }
@@ -549,6 +701,75 @@ static ssize_t proc_debug_write(struct file *file, const char __user *buf,
 
 PROC_DECLARE_RW(debug)
 
+static int proc_buffer_pools_read(struct seq_file *sf, void *v)
+{
+	struct ndis_buffer_pool *pool;
+
+	add_text("%-18s %8s %8s %8s %10s %10s %10s\n", "pool", "max",
+		 "alloc", "free", "hits", "misses", "trimmed");
+	spin_lock_bh(&ndis_buffer_pool_list_lock);
+	nt_list_for_each_entry(pool, &ndis_buffer_pool_list, list)
+		add_text("%-18p %8u %8u %8u %10u %10u %10u\n", pool,
+			 pool->max_descr, pool->num_allocated_descr,
+			 (unsigned int)pool->free_list.depth,
+			 pool->hits, pool->misses, pool->trimmed);
+	spin_unlock_bh(&ndis_buffer_pool_list_lock);
+	return 0;
+}
+
+PROC_DECLARE_RO(buffer_pools)
+
+static int proc_pool_read(struct seq_file *sf, void *v)
+{
+	struct pool_tag *pool_tag;
+	char tag[5];
+	int i;
+
+	add_text("%-4s %10s %10s %10s %8s\n", "tag", "blocks", "bytes",
+		 "allocs", "failed");
+	rcu_read_lock();
+	list_for_each_entry_rcu(pool_tag, &pool_tag_list, list) {
+		/* tags are usually four characters, first one in
+		 * lowest byte */
+		for (i = 0; i < 4; i++) {
+			tag[i] = (pool_tag->tag >> (i * 8)) & 0xff;
+			if (!isprint(tag[i]))
+				tag[i] = '.';
+		}
+		tag[4] = 0;
+		add_text("%-4s %10d %10d %10d %8d\n", tag,
+			 atomic_read(&pool_tag->count),
+			 atomic_read(&pool_tag->bytes),
+			 atomic_read(&pool_tag->allocs),
+			 atomic_read(&pool_tag->failures));
+	}
+	rcu_read_unlock();
+	return 0;
+}
+
+PROC_DECLARE_RO(pool)
+
+static int proc_spinlocks_read(struct seq_file *sf, void *v)
+{
+#ifdef CONFIG_SMP
+	struct nt_spin_lock_site *lock_site;
+	int i;
+
+	add_text("%-40s %10s %14s\n", "site", "contended", "spins");
+	for (i = 0; i < (1 << NT_SPIN_LOCK_SITE_BITS); i++) {
+		lock_site = &nt_spin_lock_sites[i];
+		if (!ACCESS_ONCE(lock_site->site))
+			continue;
+		add_text("%-40pS %10d %14ld\n", lock_site->site,
+			 atomic_read(&lock_site->contended),
+			 atomic_long_read(&lock_site->spins));
+	}
+#endif
+	return 0;
+}
+
+PROC_DECLARE_RO(spinlocks)
+
 int wrap_procfs_init(void)
 {
 	int ret;
@@ -575,6 +796,18 @@ int wrap_procfs_init(void)
 	proc_set_user(wrap_procfs_entry, proc_kuid, proc_kgid);
 
 	ret = proc_make_entry_rw(debug, wrap_procfs_entry, NULL);
+	if (ret)
+		return ret;
+	ret = proc_make_entry_ro(buffer_pools, wrap_procfs_entry, NULL);
+	if (ret)
+		return ret;
+	ret = proc_make_entry_ro(timers, wrap_procfs_entry, NULL);
+	if (ret)
+		return ret;
+	ret = proc_make_entry_ro(pool, wrap_procfs_entry, NULL);
+	if (ret)
+		return ret;
+	ret = proc_make_entry_ro(spinlocks, wrap_procfs_entry, NULL);
 
 	return ret;
 }
@@ -583,6 +816,10 @@ void wrap_procfs_remove(void)
 {
 	if (wrap_procfs_entry == NULL)
 		return;
+	remove_proc_entry("spinlocks", wrap_procfs_entry);
+	remove_proc_entry("pool", wrap_procfs_entry);
+	remove_proc_entry("timers", wrap_procfs_entry);
+	remove_proc_entry("buffer_pools", wrap_procfs_entry);
 	remove_proc_entry("debug", wrap_procfs_entry);
 	proc_remove(wrap_procfs_entry);
 }
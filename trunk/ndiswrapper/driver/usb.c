@@ -16,6 +16,7 @@
 
 #include "ndis.h"
 #include "usb.h"
+#include "wrapper.h"
 #include "usb_exports.h"
 
 #ifdef USB_DEBUG
@@ -71,8 +72,44 @@ static unsigned int urb_id = 0;
 #endif
 
 /* wrap_urb->flags */
-/* transfer_buffer for urb is allocated; free it in wrap_free_urb */
+/* transfer_buffer for urb is a bounce buffer; return it to cache in
+ * wrap_free_urb */
 #define WRAP_URB_COPY_BUFFER 0x01
+/* vmalloc'ed transfer buffer is mapped with urb->sg */
+#define WRAP_URB_SG 0x02
+/* urb has isochronous packet descriptors; it is not reused */
+#define WRAP_URB_ISO 0x04
+
+/* USBD limits isochronous transfers to 1024 packets (high speed) */
+#define MAX_ISO_PACKETS 1024
+
+/* coherent DMA buffers used as bounce buffers for transfer buffers
+ * that can't be mapped are cached per pipe (endpoint and direction)
+ * instead of being allocated for every urb */
+struct wrap_dma_buf {
+	struct nt_list list;
+	void *buf;
+	dma_addr_t dma;
+	unsigned int size;
+	unsigned int cache;
+};
+
+struct wrap_dma_buf_cache {
+	spinlock_t lock;
+	struct nt_list bufs;
+	int count;
+};
+
+#define DMA_BUF_CACHES 32
+#define DMA_BUF_CACHE_DEPTH URBS_PER_PIPE
+
+static inline unsigned int dma_buf_cache_index(unsigned int pipe)
+{
+	return usb_pipeendpoint(pipe) | (usb_pipein(pipe) ? 16 : 0);
+}
+
+static void wrap_put_dma_buf(struct wrap_device *wd,
+			     struct wrap_dma_buf *dma_buf);
 
 static inline int wrap_cancel_urb(struct wrap_urb *wrap_urb)
 {
@@ -92,6 +129,29 @@ static inline int wrap_cancel_urb(struct wrap_urb *wrap_urb)
 
 #define URB_STATUS(wrap_urb) (wrap_urb->urb->status)
 
+/* completed urbs are queued on the device's queue for their
+ * endpoint (and direction); IRPs on a queue are completed in order by
+ * one thread at a time - either the urb completion that finds the
+ * queue idle, or usb_wq's worker - so the driver sees them in the
+ * order urbs completed; global list is used only if a device has no
+ * queues */
+struct wrap_urb_complete_queue {
+	spinlock_t lock;
+	struct nt_list list;
+	/* a thread is completing IRPs on this queue */
+	BOOLEAN busy;
+	struct work_struct work;
+};
+
+#define URB_COMPLETE_QUEUES 32
+
+static inline unsigned int urb_complete_queue_index(unsigned int pipe)
+{
+	return usb_pipeendpoint(pipe) | (usb_pipein(pipe) ? 16 : 0);
+}
+
+static struct workqueue_struct *usb_wq;
+
 static struct nt_list wrap_urb_complete_list;
 static spinlock_t wrap_urb_complete_list_lock;
 
@@ -102,6 +162,7 @@ static void kill_all_urbs(struct wrap_device *wd, int complete)
 {
 	struct nt_list *ent;
 	struct wrap_urb *wrap_urb;
+	unsigned long flags;
 	KIRQL irql;
 
 	USBTRACE("%d", wd->usb.num_alloc_urbs);
@@ -120,12 +181,225 @@ static void kill_all_urbs(struct wrap_device *wd, int complete)
 			usb_kill_urb(wrap_urb->urb);
 		}
 		USBTRACE("%p, %p", wrap_urb, wrap_urb->urb);
+		if (wrap_urb->dma_buf)
+			wrap_put_dma_buf(wd, wrap_urb->dma_buf);
 		usb_free_urb(wrap_urb->urb);
+		kfree(wrap_urb->sg);
 		kfree(wrap_urb);
 	}
+	spin_lock_irqsave(&wd->usb.free_urbs_lock, flags);
+	InitializeListHead(&wd->usb.free_urbs);
+	spin_unlock_irqrestore(&wd->usb.free_urbs_lock, flags);
 	wd->usb.num_alloc_urbs = 0;
 }
 
+/* allocate a new urb and add it to device's list of urbs */
+static struct wrap_urb *wrap_new_urb(struct wrap_device *wd,
+				     int num_iso_packets, gfp_t alloc_flags)
+{
+	struct wrap_urb *wrap_urb;
+	KIRQL irql;
+
+	wrap_urb = kzalloc(sizeof(*wrap_urb), alloc_flags);
+	if (!wrap_urb) {
+		WARNING("couldn't allocate memory");
+		return NULL;
+	}
+	wrap_urb->urb = usb_alloc_urb(num_iso_packets, alloc_flags);
+	if (!wrap_urb->urb) {
+		WARNING("couldn't allocate urb");
+		kfree(wrap_urb);
+		return NULL;
+	}
+	wrap_urb->state = URB_ALLOCATED;
+	IoAcquireCancelSpinLock(&irql);
+	InsertTailList(&wd->usb.wrap_urb_list, &wrap_urb->list);
+	wd->usb.num_alloc_urbs++;
+	IoReleaseCancelSpinLock(irql);
+	return wrap_urb;
+}
+
+static void wrap_put_free_urb(struct wrap_device *wd,
+			      struct wrap_urb *wrap_urb)
+{
+	unsigned long flags;
+
+	wrap_urb->state = URB_FREE;
+	wrap_urb->flags = 0;
+	wrap_urb->irp = NULL;
+	spin_lock_irqsave(&wd->usb.free_urbs_lock, flags);
+	InsertHeadList(&wd->usb.free_urbs, &wrap_urb->free_list);
+	spin_unlock_irqrestore(&wd->usb.free_urbs_lock, flags);
+}
+
+static struct wrap_urb *wrap_get_free_urb(struct wrap_device *wd)
+{
+	struct nt_list *ent;
+	unsigned long flags;
+
+	spin_lock_irqsave(&wd->usb.free_urbs_lock, flags);
+	ent = RemoveHeadList(&wd->usb.free_urbs);
+	spin_unlock_irqrestore(&wd->usb.free_urbs_lock, flags);
+	if (!ent)
+		return NULL;
+	return container_of(ent, struct wrap_urb, free_list);
+}
+
+/* make sure there are at least 'n' urbs for the device, so
+ * submitting urbs doesn't have to allocate them */
+static void wrap_prealloc_urbs(struct wrap_device *wd, int n)
+{
+	struct wrap_urb *wrap_urb;
+
+	wd->usb.max_alloc_urbs = max(n, MAX_ALLOCATED_URBS);
+	USBTRACE("%d, %d", wd->usb.num_alloc_urbs, wd->usb.max_alloc_urbs);
+	while (wd->usb.num_alloc_urbs < n) {
+		wrap_urb = wrap_new_urb(wd, 0, irql_gfp());
+		if (!wrap_urb)
+			break;
+		wrap_put_free_urb(wd, wrap_urb);
+	}
+}
+
+static struct wrap_dma_buf *wrap_get_dma_buf(struct wrap_device *wd,
+					     unsigned int pipe,
+					     unsigned int len, gfp_t alloc_flags)
+{
+	struct wrap_dma_buf_cache *cache;
+	struct wrap_dma_buf *dma_buf;
+	unsigned long flags;
+	unsigned int index;
+
+	index = dma_buf_cache_index(pipe);
+	if (wd->usb.dma_bufs) {
+		cache = &wd->usb.dma_bufs[index];
+		spin_lock_irqsave(&cache->lock, flags);
+		nt_list_for_each_entry(dma_buf, &cache->bufs, list) {
+			if (dma_buf->size >= len) {
+				RemoveEntryList(&dma_buf->list);
+				cache->count--;
+				spin_unlock_irqrestore(&cache->lock, flags);
+				return dma_buf;
+			}
+		}
+		spin_unlock_irqrestore(&cache->lock, flags);
+	}
+	dma_buf = kmalloc(sizeof(*dma_buf), alloc_flags);
+	if (!dma_buf)
+		return NULL;
+	/* round up so the buffer can be reused for other lengths */
+	dma_buf->size = roundup_pow_of_two(len);
+	dma_buf->cache = index;
+	dma_buf->buf = usb_alloc_coherent(wd->usb.udev, dma_buf->size,
+					  alloc_flags, &dma_buf->dma);
+	if (!dma_buf->buf) {
+		kfree(dma_buf);
+		return NULL;
+	}
+	USBTRACE("%p, %u", dma_buf->buf, dma_buf->size);
+	return dma_buf;
+}
+
+static void wrap_put_dma_buf(struct wrap_device *wd,
+			     struct wrap_dma_buf *dma_buf)
+{
+	struct wrap_dma_buf_cache *cache;
+	unsigned long flags;
+
+	if (wd->usb.dma_bufs) {
+		cache = &wd->usb.dma_bufs[dma_buf->cache];
+		spin_lock_irqsave(&cache->lock, flags);
+		if (cache->count < DMA_BUF_CACHE_DEPTH) {
+			InsertHeadList(&cache->bufs, &dma_buf->list);
+			cache->count++;
+			spin_unlock_irqrestore(&cache->lock, flags);
+			return;
+		}
+		spin_unlock_irqrestore(&cache->lock, flags);
+	}
+	usb_free_coherent(wd->usb.udev, dma_buf->size, dma_buf->buf,
+			  dma_buf->dma);
+	kfree(dma_buf);
+}
+
+static void wrap_free_dma_bufs(struct wrap_device *wd)
+{
+	struct wrap_dma_buf *dma_buf;
+	struct nt_list *ent;
+	int i;
+
+	if (!wd->usb.dma_bufs)
+		return;
+	for (i = 0; i < DMA_BUF_CACHES; i++) {
+		while ((ent = RemoveHeadList(&wd->usb.dma_bufs[i].bufs))) {
+			dma_buf = container_of(ent, struct wrap_dma_buf, list);
+			usb_free_coherent(wd->usb.udev, dma_buf->size,
+					  dma_buf->buf, dma_buf->dma);
+			kfree(dma_buf);
+		}
+		wd->usb.dma_bufs[i].count = 0;
+	}
+}
+
+#if LINUX_VERSION_CODE >= KERNEL_VERSION(2,6,35)
+/* map vmalloc'ed buffer with a scatterlist so host controller can
+ * transfer to/from it directly, without a bounce buffer */
+static int wrap_map_urb_sg(struct wrap_device *wd, struct wrap_urb *wrap_urb,
+			   unsigned int pipe, void *buf, unsigned int len,
+			   gfp_t alloc_flags)
+{
+	struct usb_device *udev = wd->usb.udev;
+	struct urb *urb = wrap_urb->urb;
+	unsigned int offset, n, i, maxp, chunk;
+	bool constrained = true;
+
+	if (!usb_pipebulk(pipe) || !udev->bus->sg_tablesize)
+		return -EINVAL;
+	offset = offset_in_page(buf);
+	n = DIV_ROUND_UP(offset + len, PAGE_SIZE);
+	if (n > udev->bus->sg_tablesize)
+		return -EINVAL;
+#if LINUX_VERSION_CODE >= KERNEL_VERSION(3,13,0)
+	constrained = !udev->bus->no_sg_constraint;
+#endif
+	/* USB core requires all but last sg to be multiples of
+	 * maxpacket, unless host controller can handle any lengths */
+	maxp = usb_maxpacket(udev, pipe, usb_pipeout(pipe));
+	if (n > 1 && constrained && maxp &&
+	    ((PAGE_SIZE - offset) % maxp || PAGE_SIZE % maxp))
+		return -EINVAL;
+	if (wrap_urb->sg_size < n) {
+		kfree(wrap_urb->sg);
+		wrap_urb->sg_size = 0;
+		wrap_urb->sg = kmalloc(n * sizeof(*wrap_urb->sg), alloc_flags);
+		if (!wrap_urb->sg)
+			return -ENOMEM;
+		wrap_urb->sg_size = n;
+	}
+	sg_init_table(wrap_urb->sg, n);
+	flush_kernel_vmap_range(buf, len);
+	for (i = 0; i < n; i++) {
+		chunk = min_t(unsigned int, len, PAGE_SIZE - offset);
+		sg_set_page(&wrap_urb->sg[i], vmalloc_to_page(buf), chunk,
+			    offset);
+		buf += chunk;
+		len -= chunk;
+		offset = 0;
+	}
+	urb->sg = wrap_urb->sg;
+	urb->num_sgs = n;
+	wrap_urb->flags |= WRAP_URB_SG;
+	return 0;
+}
+#else
+static int wrap_map_urb_sg(struct wrap_device *wd, struct wrap_urb *wrap_urb,
+			   unsigned int pipe, void *buf, unsigned int len,
+			   gfp_t alloc_flags)
+{
+	return -EINVAL;
+}
+#endif
+
 /* for a given Linux urb status code, return corresponding NT urb status */
 static USBD_STATUS wrap_urb_status(int urb_status)
 {
@@ -190,24 +464,23 @@ static void wrap_free_urb(struct urb *urb)
 	irp->cancel_routine = NULL;
 	IRP_WRAP_URB(irp) = NULL;
 	if (wrap_urb->flags & WRAP_URB_COPY_BUFFER) {
-		USBTRACE("freeing DMA buffer for URB: %p %p",
+		USBTRACE("releasing DMA buffer for URB: %p %p",
 			 urb, urb->transfer_buffer);
-		usb_free_coherent(wd->usb.udev, urb->transfer_buffer_length,
-				  urb->transfer_buffer, urb->transfer_dma);
+		wrap_put_dma_buf(wd, wrap_urb->dma_buf);
+		wrap_urb->dma_buf = NULL;
 	}
 	kfree(urb->setup_packet);
-	if (wd->usb.num_alloc_urbs > MAX_ALLOCATED_URBS) {
+	if ((wrap_urb->flags & WRAP_URB_ISO) ||
+	    wd->usb.num_alloc_urbs > wd->usb.max_alloc_urbs) {
 		IoAcquireCancelSpinLock(&irp->cancel_irql);
 		RemoveEntryList(&wrap_urb->list);
 		wd->usb.num_alloc_urbs--;
 		IoReleaseCancelSpinLock(irp->cancel_irql);
 		usb_free_urb(urb);
+		kfree(wrap_urb->sg);
 		kfree(wrap_urb);
-	} else {
-		wrap_urb->state = URB_FREE;
-		wrap_urb->flags = 0;
-		wrap_urb->irp = NULL;
-	}
+	} else
+		wrap_put_free_urb(wd, wrap_urb);
 	return;
 }
 
@@ -243,7 +516,8 @@ wstdcall void wrap_cancel_irp(struct device_object *dev_obj, struct irp *irp)
 WIN_FUNC_DECL(wrap_cancel_irp,2)
 
 static struct urb *wrap_alloc_urb(struct irp *irp, unsigned int pipe,
-				  void *buf, unsigned int buf_len)
+				  void *buf, unsigned int buf_len,
+				  int num_iso_packets)
 {
 	struct urb *urb;
 	gfp_t alloc_flags;
@@ -258,36 +532,24 @@ static struct urb *wrap_alloc_urb(struct irp *irp, unsigned int pipe,
 		return NULL;
 
 	alloc_flags = irql_gfp();
-	IoAcquireCancelSpinLock(&irp->cancel_irql);
-	urb = NULL;
-	nt_list_for_each_entry(wrap_urb, &wd->usb.wrap_urb_list, list) {
-		if (cmpxchg(&wrap_urb->state, URB_FREE,
-			    URB_ALLOCATED) == URB_FREE) {
-			urb = wrap_urb->urb;
-			/* Clean URB but keep the refcount */
-			memset((char *)urb + sizeof(urb->kref), 0,
-			       sizeof(*urb) - sizeof(urb->kref));
-			break;
-		}
-	}
-	if (!urb) {
-		IoReleaseCancelSpinLock(irp->cancel_irql);
-		wrap_urb = kzalloc(sizeof(*wrap_urb), alloc_flags);
-		if (!wrap_urb) {
-			WARNING("couldn't allocate memory");
-			return NULL;
-		}
-		urb = usb_alloc_urb(0, alloc_flags);
-		if (!urb) {
-			WARNING("couldn't allocate urb");
-			kfree(wrap_urb);
+	if (num_iso_packets) {
+		/* free urbs don't have room for packet descriptors */
+		wrap_urb = wrap_new_urb(wd, num_iso_packets, alloc_flags);
+		if (!wrap_urb)
 			return NULL;
-		}
-		IoAcquireCancelSpinLock(&irp->cancel_irql);
-		wrap_urb->urb = urb;
+		wrap_urb->flags |= WRAP_URB_ISO;
+		urb = wrap_urb->urb;
+	} else if ((wrap_urb = wrap_get_free_urb(wd))) {
 		wrap_urb->state = URB_ALLOCATED;
-		InsertTailList(&wd->usb.wrap_urb_list, &wrap_urb->list);
-		wd->usb.num_alloc_urbs++;
+		urb = wrap_urb->urb;
+		/* Clean URB but keep the refcount */
+		memset((char *)urb + sizeof(urb->kref), 0,
+		       sizeof(*urb) - sizeof(urb->kref));
+	} else {
+		wrap_urb = wrap_new_urb(wd, 0, alloc_flags);
+		if (!wrap_urb)
+			return NULL;
+		urb = wrap_urb->urb;
 	}
 
 #ifdef URB_ASYNC_UNLINK
@@ -296,6 +558,7 @@ static struct urb *wrap_alloc_urb(struct irp *irp, unsigned int pipe,
 	urb->transfer_flags |= USB_ASYNC_UNLINK;
 #endif
 	urb->context = wrap_urb;
+	IoAcquireCancelSpinLock(&irp->cancel_irql);
 	wrap_urb->irp = irp;
 	IRP_WRAP_URB(irp) = wrap_urb;
 	/* called as Windows function */
@@ -309,21 +572,27 @@ static struct urb *wrap_alloc_urb(struct irp *irp, unsigned int pipe,
 			       || PageHighMem(virt_to_page(buf))
 #endif
 		    )) {
-		urb->transfer_buffer =
-			usb_alloc_coherent(wd->usb.udev, buf_len, alloc_flags,
-					 &urb->transfer_dma);
-		if (!urb->transfer_buffer) {
+		if (is_vmalloc_addr(buf) &&
+		    wrap_map_urb_sg(wd, wrap_urb, pipe, buf, buf_len,
+				    alloc_flags) == 0) {
+			urb->transfer_buffer = NULL;
+			USBTRACE("sg for urb %p: %d", urb, urb->num_sgs);
+			return urb;
+		}
+		wrap_urb->dma_buf = wrap_get_dma_buf(wd, pipe, buf_len,
+						     alloc_flags);
+		if (!wrap_urb->dma_buf) {
 			WARNING("couldn't allocate dma buf");
 			IoAcquireCancelSpinLock(&irp->cancel_irql);
 			irp->cancel_routine = NULL;
-			wrap_urb->state = URB_FREE;
-			wrap_urb->irp = NULL;
 			IRP_WRAP_URB(irp) = NULL;
 			IoReleaseCancelSpinLock(irp->cancel_irql);
+			wrap_put_free_urb(wd, wrap_urb);
 			return NULL;
 		}
-		if (urb->transfer_dma)
-			urb->transfer_flags |= URB_NO_TRANSFER_DMA_MAP;
+		urb->transfer_buffer = wrap_urb->dma_buf->buf;
+		urb->transfer_dma = wrap_urb->dma_buf->dma;
+		urb->transfer_flags |= URB_NO_TRANSFER_DMA_MAP;
 		wrap_urb->flags |= WRAP_URB_COPY_BUFFER;
 		if (usb_pipeout(pipe))
 			memcpy(urb->transfer_buffer, buf, buf_len);
@@ -369,10 +638,136 @@ static USBD_STATUS wrap_submit_urb(struct irp *irp)
 		USBEXIT(return USBD_STATUS_PENDING);
 }
 
+static void wrap_urb_complete_irp(struct wrap_urb *wrap_urb)
+{
+	struct irp *irp;
+	struct urb *urb;
+	struct usbd_bulk_or_intr_transfer *bulk_int_tx;
+	struct usbd_vendor_or_class_request *vc_req;
+	struct usbd_isochronous_transfer *iso_tx;
+	union nt_urb *nt_urb;
+	int i;
+
+	urb = wrap_urb->urb;
+#ifdef USB_DEBUG
+	if (wrap_urb->state != URB_COMPLETED &&
+	    wrap_urb->state != URB_INT_UNLINKED)
+		WARNING("urb %p in wrong state: %d", urb, wrap_urb->state);
+#endif
+	irp = wrap_urb->irp;
+	DUMP_IRP(irp);
+	nt_urb = IRP_URB(irp);
+	USBTRACE("urb: %p, nt_urb: %p, status: %d",
+		 urb, nt_urb, urb->status);
+	if (nt_urb->header.function == URB_FUNCTION_ISOCH_TRANSFER) {
+		/* packets are reported even if transfer failed */
+		iso_tx = &nt_urb->isochronous;
+		iso_tx->start_frame = urb->start_frame;
+		iso_tx->error_count = urb->error_count;
+		for (i = 0; i < urb->number_of_packets; i++) {
+			iso_tx->iso_packet[i].status =
+				wrap_urb_status(urb->iso_frame_desc[i].status);
+			if (usb_pipein(urb->pipe))
+				iso_tx->iso_packet[i].length =
+					urb->iso_frame_desc[i].actual_length;
+		}
+	}
+	switch (urb->status) {
+	case 0:
+		/* successfully transferred */
+		irp->io_status.info = urb->actual_length;
+		if (nt_urb->header.function == URB_FUNCTION_ISOCH_TRANSFER) {
+			iso_tx = &nt_urb->isochronous;
+			if ((wrap_urb->flags & WRAP_URB_COPY_BUFFER) &&
+			    usb_pipein(urb->pipe))
+				memcpy(iso_tx->transfer_buffer,
+				       urb->transfer_buffer,
+				       urb->transfer_buffer_length);
+			if (usb_pipein(urb->pipe))
+				iso_tx->transfer_buffer_length =
+					urb->actual_length;
+		} else if (nt_urb->header.function ==
+		    URB_FUNCTION_BULK_OR_INTERRUPT_TRANSFER) {
+			bulk_int_tx = &nt_urb->bulk_int_transfer;
+			bulk_int_tx->transfer_buffer_length =
+				urb->actual_length;
+			DUMP_URB_BUFFER(urb, USB_DIR_IN);
+			if ((wrap_urb->flags & WRAP_URB_COPY_BUFFER) &&
+			    usb_pipein(urb->pipe))
+				memcpy(bulk_int_tx->transfer_buffer,
+				       urb->transfer_buffer,
+				       urb->actual_length);
+#if LINUX_VERSION_CODE >= KERNEL_VERSION(2,6,35)
+			else if ((wrap_urb->flags & WRAP_URB_SG) &&
+				 usb_pipein(urb->pipe))
+				invalidate_kernel_vmap_range(
+					bulk_int_tx->transfer_buffer,
+					urb->actual_length);
+#endif
+		} else { // vendor or class request
+			vc_req = &nt_urb->vendor_class_request;
+			vc_req->transfer_buffer_length =
+				urb->actual_length;
+			DUMP_URB_BUFFER(urb, USB_DIR_IN);
+			if ((wrap_urb->flags & WRAP_URB_COPY_BUFFER) &&
+			    usb_pipein(urb->pipe))
+				memcpy(vc_req->transfer_buffer,
+				       urb->transfer_buffer,
+				       urb->actual_length);
+		}
+		NT_URB_STATUS(nt_urb) = USBD_STATUS_SUCCESS;
+		irp->io_status.status = STATUS_SUCCESS;
+		break;
+	case -ENOENT:
+	case -ECONNRESET:
+		/* urb canceled */
+		irp->io_status.info = 0;
+		TRACE2("urb %p canceled", urb);
+		NT_URB_STATUS(nt_urb) = USBD_STATUS_SUCCESS;
+		irp->io_status.status = STATUS_CANCELLED;
+		break;
+	default:
+		TRACE2("irp: %p, urb: %p, status: %d/%d",
+			 irp, urb, urb->status, wrap_urb->state);
+		irp->io_status.info = 0;
+		NT_URB_STATUS(nt_urb) = wrap_urb_status(urb->status);
+		irp->io_status.status =
+			nt_urb_irp_status(NT_URB_STATUS(nt_urb));
+		break;
+	}
+	wrap_free_urb(urb);
+	IoCompleteRequest(irp, IO_NO_INCREMENT);
+}
+
+/* complete IRPs on queue until it is empty; called by the thread
+ * that set queue->busy */
+static void wrap_urb_complete_queue_run(struct wrap_urb_complete_queue *queue)
+{
+	struct wrap_urb *wrap_urb;
+	struct nt_list *ent;
+	unsigned long flags;
+
+	while (1) {
+		spin_lock_irqsave(&queue->lock, flags);
+		ent = RemoveHeadList(&queue->list);
+		if (!ent)
+			queue->busy = FALSE;
+		spin_unlock_irqrestore(&queue->lock, flags);
+		if (!ent)
+			break;
+		wrap_urb = container_of(ent, struct wrap_urb, complete_list);
+		wrap_urb_complete_irp(wrap_urb);
+	}
+}
+
 static void wrap_urb_complete(struct urb *urb ISR_PT_REGS_PARAM_DECL)
 {
 	struct irp *irp;
 	struct wrap_urb *wrap_urb;
+	struct wrap_device *wd;
+	struct wrap_urb_complete_queue *queue;
+	unsigned long flags;
+	BOOLEAN direct;
 
 	wrap_urb = urb->context;
 	USBTRACE("%p (%p) completed", wrap_urb, urb);
@@ -387,94 +782,565 @@ static void wrap_urb_complete(struct urb *urb ISR_PT_REGS_PARAM_DECL)
 	}
 #endif
 	wrap_urb->state = URB_COMPLETED;
+	/* if enabled, IRP can be completed here, without a thread
+	 * switch, unless host controller completes urbs in hard
+	 * interrupt context; completion routines then run in softirq
+	 * context, where current_irql reports SOFT_IRQL, not the
+	 * DISPATCH_LEVEL they run at in Windows */
+	direct = (usb_complete_direct && !in_irq() && !irqs_disabled());
+	wd = IRP_WRAP_DEVICE(irp);
+	if (wd->usb.complete_queues) {
+		queue = &wd->usb.complete_queues[
+			urb_complete_queue_index(urb->pipe)];
+		spin_lock_irqsave(&queue->lock, flags);
+		InsertTailList(&queue->list, &wrap_urb->complete_list);
+		if (queue->busy) {
+			/* completed by thread that owns the queue */
+			spin_unlock_irqrestore(&queue->lock, flags);
+			return;
+		}
+		queue->busy = TRUE;
+		spin_unlock_irqrestore(&queue->lock, flags);
+		if (direct)
+			wrap_urb_complete_queue_run(queue);
+		else
+			queue_work(usb_wq, &queue->work);
+		return;
+	}
+	if (direct) {
+		wrap_urb_complete_irp(wrap_urb);
+		return;
+	}
 	spin_lock(&wrap_urb_complete_list_lock);
 	InsertTailList(&wrap_urb_complete_list, &wrap_urb->complete_list);
 	spin_unlock(&wrap_urb_complete_list_lock);
 	queue_work(ntos_wq, &wrap_urb_complete_work);
 }
 
-/* one worker for all devices */
-static void wrap_urb_complete_worker(struct work_struct *dummy)
+static void wrap_urb_complete_list_run(struct nt_list *head, spinlock_t *lock)
 {
-	struct irp *irp;
-	struct urb *urb;
-	struct usbd_bulk_or_intr_transfer *bulk_int_tx;
-	struct usbd_vendor_or_class_request *vc_req;
-	union nt_urb *nt_urb;
 	struct wrap_urb *wrap_urb;
 	struct nt_list *ent;
 	unsigned long flags;
 
-	USBENTER("");
 	while (1) {
-		spin_lock_irqsave(&wrap_urb_complete_list_lock, flags);
-		ent = RemoveHeadList(&wrap_urb_complete_list);
-		spin_unlock_irqrestore(&wrap_urb_complete_list_lock, flags);
+		spin_lock_irqsave(lock, flags);
+		ent = RemoveHeadList(head);
+		spin_unlock_irqrestore(lock, flags);
 		if (!ent)
 			break;
 		wrap_urb = container_of(ent, struct wrap_urb, complete_list);
-		urb = wrap_urb->urb;
-#ifdef USB_DEBUG
-		if (wrap_urb->state != URB_COMPLETED &&
-		    wrap_urb->state != URB_INT_UNLINKED)
-			WARNING("urb %p in wrong state: %d",
-				urb, wrap_urb->state);
-#endif
-		irp = wrap_urb->irp;
-		DUMP_IRP(irp);
-		nt_urb = IRP_URB(irp);
-		USBTRACE("urb: %p, nt_urb: %p, status: %d",
-			 urb, nt_urb, urb->status);
-		switch (urb->status) {
-		case 0:
-			/* successfully transferred */
-			irp->io_status.info = urb->actual_length;
-			if (nt_urb->header.function ==
-			    URB_FUNCTION_BULK_OR_INTERRUPT_TRANSFER) {
-				bulk_int_tx = &nt_urb->bulk_int_transfer;
-				bulk_int_tx->transfer_buffer_length =
-					urb->actual_length;
-				DUMP_URB_BUFFER(urb, USB_DIR_IN);
-				if ((wrap_urb->flags & WRAP_URB_COPY_BUFFER) &&
-				    usb_pipein(urb->pipe))
-					memcpy(bulk_int_tx->transfer_buffer,
-					       urb->transfer_buffer,
-					       urb->actual_length);
-			} else { // vendor or class request
-				vc_req = &nt_urb->vendor_class_request;
-				vc_req->transfer_buffer_length =
-					urb->actual_length;
-				DUMP_URB_BUFFER(urb, USB_DIR_IN);
-				if ((wrap_urb->flags & WRAP_URB_COPY_BUFFER) &&
-				    usb_pipein(urb->pipe))
-					memcpy(vc_req->transfer_buffer,
-					       urb->transfer_buffer,
-					       urb->actual_length);
-			}
-			NT_URB_STATUS(nt_urb) = USBD_STATUS_SUCCESS;
-			irp->io_status.status = STATUS_SUCCESS;
+		wrap_urb_complete_irp(wrap_urb);
+	}
+}
+
+/* worker for a queue handed to it by wrap_urb_complete */
+static void wrap_urb_complete_queue_worker(struct work_struct *work)
+{
+	struct wrap_urb_complete_queue *queue;
+
+	USBENTER("");
+	queue = container_of(work, struct wrap_urb_complete_queue, work);
+	wrap_urb_complete_queue_run(queue);
+	USBEXIT(return);
+}
+
+/* one worker for all devices without their own queues */
+static void wrap_urb_complete_worker(struct work_struct *dummy)
+{
+	USBENTER("");
+	wrap_urb_complete_list_run(&wrap_urb_complete_list,
+				   &wrap_urb_complete_list_lock);
+	USBEXIT(return);
+}
+
+struct wrap_readahead_buf {
+	struct nt_list list;
+	struct nt_list all_list;
+	struct urb *urb;
+	struct wrap_readahead *ra;
+	unsigned int offset;
+};
+
+static void wrap_readahead_complete(struct urb *urb ISR_PT_REGS_PARAM_DECL);
+
+static struct wrap_readahead_buf *
+wrap_readahead_alloc_buf(struct wrap_readahead *ra)
+{
+	struct wrap_readahead_buf *rb;
+	struct wrap_device *wd = ra->wd;
+	gfp_t alloc_flags = irql_gfp();
+	unsigned long flags;
+	void *buf;
+
+	rb = kzalloc(sizeof(*rb), alloc_flags);
+	if (!rb)
+		return NULL;
+	rb->urb = usb_alloc_urb(0, alloc_flags);
+	if (!rb->urb) {
+		kfree(rb);
+		return NULL;
+	}
+	buf = kmalloc(ra->buf_size, alloc_flags);
+	if (!buf) {
+		usb_free_urb(rb->urb);
+		kfree(rb);
+		return NULL;
+	}
+	rb->ra = ra;
+	usb_fill_bulk_urb(rb->urb, wd->usb.udev, ra->pipe, buf, ra->buf_size,
+			  wrap_readahead_complete, rb);
+	spin_lock_irqsave(&ra->lock, flags);
+	InsertTailList(&ra->bufs, &rb->all_list);
+	ra->num_bufs++;
+	spin_unlock_irqrestore(&ra->lock, flags);
+	USBTRACE("%p, %p, %u", rb, rb->urb, ra->buf_size);
+	return rb;
+}
+
+/* keep up to read-ahead depth buffers submitted or holding data */
+static void wrap_readahead_fill(struct wrap_readahead *ra)
+{
+	struct wrap_readahead_buf *rb;
+	struct nt_list *ent;
+	unsigned long flags;
+	int ret, depth;
+
+	while (1) {
+		spin_lock_irqsave(&ra->lock, flags);
+		/* after depth is reduced to 0, reads already queued
+		 * still need a buffer */
+		depth = ra->wd->usb.readahead_depth;
+		if (depth == 0 && !IsListEmpty(&ra->irps))
+			depth = 1;
+		if (ra->stopped || test_bit(HW_DISABLED, &ra->wd->hw_status) ||
+		    ra->submitted + ra->num_ready >= depth) {
+			spin_unlock_irqrestore(&ra->lock, flags);
 			break;
-		case -ENOENT:
-		case -ECONNRESET:
-			/* urb canceled */
-			irp->io_status.info = 0;
-			TRACE2("urb %p canceled", urb);
-			NT_URB_STATUS(nt_urb) = USBD_STATUS_SUCCESS;
-			irp->io_status.status = STATUS_CANCELLED;
+		}
+		ent = RemoveHeadList(&ra->idle);
+		ra->submitted++;
+		spin_unlock_irqrestore(&ra->lock, flags);
+		if (ent)
+			rb = container_of(ent, struct wrap_readahead_buf, list);
+		else {
+			rb = wrap_readahead_alloc_buf(ra);
+			if (!rb) {
+				spin_lock_irqsave(&ra->lock, flags);
+				ra->submitted--;
+				spin_unlock_irqrestore(&ra->lock, flags);
+				break;
+			}
+		}
+		rb->offset = 0;
+		ret = usb_submit_urb(rb->urb, irql_gfp());
+		if (ret) {
+			USBTRACE("ret: %d", ret);
+			spin_lock_irqsave(&ra->lock, flags);
+			ra->submitted--;
+			ra->stopped = TRUE;
+			InsertHeadList(&ra->idle, &rb->list);
+			spin_unlock_irqrestore(&ra->lock, flags);
 			break;
-		default:
-			TRACE2("irp: %p, urb: %p, status: %d/%d",
-				 irp, urb, urb->status, wrap_urb->state);
-			irp->io_status.info = 0;
-			NT_URB_STATUS(nt_urb) = wrap_urb_status(urb->status);
-			irp->io_status.status =
-				nt_urb_irp_status(NT_URB_STATUS(nt_urb));
+		}
+	}
+}
+
+/* copy (part of) data in buffer 'rb' to IRP's buffer; if buffer
+ * failed, its status is returned; called with ra->lock held */
+static int wrap_readahead_copy(struct wrap_readahead *ra,
+			       struct wrap_readahead_buf *rb,
+			       struct irp *irp)
+{
+	struct usbd_bulk_or_intr_transfer *bulk_int_tx;
+	struct urb *urb = rb->urb;
+	unsigned int len;
+	int status;
+
+	bulk_int_tx = &IRP_URB(irp)->bulk_int_transfer;
+	status = urb->status;
+	if (status == 0) {
+		len = min_t(unsigned int, urb->actual_length - rb->offset,
+			    bulk_int_tx->transfer_buffer_length);
+		memcpy(bulk_int_tx->transfer_buffer,
+		       urb->transfer_buffer + rb->offset, len);
+		rb->offset += len;
+		bulk_int_tx->transfer_buffer_length = len;
+		irp->io_status.info = len;
+	}
+	/* buffer is reused once its data is consumed; a short
+	 * IRP leaves rest of data for next IRP */
+	if (status || rb->offset >= urb->actual_length) {
+		RemoveEntryList(&rb->list);
+		ra->num_ready--;
+		InsertTailList(&ra->idle, &rb->list);
+	}
+	return status;
+}
+
+/* pipe stopped by an error or abort starts reading ahead again
+ * once everything received before has been consumed; called with
+ * ra->lock held */
+static void wrap_readahead_restart(struct wrap_readahead *ra)
+{
+	if (ra->stopped && ra->num_ready == 0 && ra->submitted == 0)
+		ra->stopped = FALSE;
+}
+
+static void wrap_readahead_complete_irp(struct irp *irp, int status)
+{
+	union nt_urb *nt_urb = IRP_URB(irp);
+
+	switch (status) {
+	case 0:
+		NT_URB_STATUS(nt_urb) = USBD_STATUS_SUCCESS;
+		irp->io_status.status = STATUS_SUCCESS;
+		break;
+	case -ENOENT:
+	case -ECONNRESET:
+		irp->io_status.info = 0;
+		NT_URB_STATUS(nt_urb) = USBD_STATUS_SUCCESS;
+		irp->io_status.status = STATUS_CANCELLED;
+		break;
+	default:
+		irp->io_status.info = 0;
+		NT_URB_STATUS(nt_urb) = wrap_urb_status(status);
+		irp->io_status.status =
+			nt_urb_irp_status(NT_URB_STATUS(nt_urb));
+		break;
+	}
+	IoCompleteRequest(irp, IO_NO_INCREMENT);
+}
+
+/* give received data to waiting IRPs and resubmit emptied buffers */
+static void wrap_readahead_process(struct wrap_readahead *ra)
+{
+	struct wrap_readahead_buf *rb;
+	struct nt_list *ent;
+	struct irp *irp;
+	unsigned long flags;
+	int status;
+
+	spin_lock_irqsave(&ra->lock, flags);
+	/* only one thread hands out buffers, so IRPs are completed
+	 * in the order data was received */
+	if (ra->processing) {
+		spin_unlock_irqrestore(&ra->lock, flags);
+		return;
+	}
+	ra->processing = TRUE;
+	while (!IsListEmpty(&ra->ready) && !IsListEmpty(&ra->irps)) {
+		ent = RemoveHeadList(&ra->irps);
+		irp = container_of(ent, struct irp, tail.overlay.list);
+		InitializeListHead(&irp->tail.overlay.list);
+		/* if cancel routine is already gone, IRP is being
+		 * canceled and will be completed by it */
+		if (xchg(&irp->cancel_routine, NULL) == NULL)
+			continue;
+		rb = container_of(ra->ready.next, struct wrap_readahead_buf,
+				  list);
+		status = wrap_readahead_copy(ra, rb, irp);
+		spin_unlock_irqrestore(&ra->lock, flags);
+		wrap_readahead_complete_irp(irp, status);
+		spin_lock_irqsave(&ra->lock, flags);
+	}
+	ra->processing = FALSE;
+	wrap_readahead_restart(ra);
+	spin_unlock_irqrestore(&ra->lock, flags);
+	wrap_readahead_fill(ra);
+}
+
+static void wrap_readahead_worker(struct work_struct *work)
+{
+	struct wrap_readahead *ra;
+	struct nt_list *ent;
+	struct irp *irp;
+	unsigned long flags;
+
+	ra = container_of(work, struct wrap_readahead, work);
+	while (1) {
+		spin_lock_irqsave(&ra->lock, flags);
+		ent = RemoveHeadList(&ra->canceled);
+		spin_unlock_irqrestore(&ra->lock, flags);
+		if (!ent)
 			break;
+		irp = container_of(ent, struct irp, tail.overlay.list);
+		wrap_readahead_complete_irp(irp, -ENOENT);
+	}
+	wrap_readahead_process(ra);
+}
+
+static void wrap_readahead_complete(struct urb *urb ISR_PT_REGS_PARAM_DECL)
+{
+	struct wrap_readahead_buf *rb = urb->context;
+	struct wrap_readahead *ra = rb->ra;
+	unsigned long flags;
+	BOOLEAN restart;
+
+	USBTRACE("%p, %d, %d", urb, urb->status, urb->actual_length);
+	spin_lock_irqsave(&ra->lock, flags);
+	ra->submitted--;
+	if (ra->stopped && (urb->status == -ENOENT ||
+			    urb->status == -ECONNRESET ||
+			    urb->status == -ESHUTDOWN)) {
+		/* pipe aborted; data, if any, is discarded */
+		InsertTailList(&ra->idle, &rb->list);
+		restart = (ra->submitted == 0 && !IsListEmpty(&ra->irps));
+		spin_unlock_irqrestore(&ra->lock, flags);
+		/* reads submitted since abort wait for this */
+		if (restart)
+			queue_work(usb_wq, &ra->work);
+		return;
+	}
+	InsertTailList(&ra->ready, &rb->list);
+	ra->num_ready++;
+	/* an error is reported to next IRP; buffers are not
+	 * resubmitted until the driver reads again */
+	if (urb->status)
+		ra->stopped = TRUE;
+	spin_unlock_irqrestore(&ra->lock, flags);
+	if (usb_complete_direct && !in_irq() && !irqs_disabled())
+		wrap_readahead_process(ra);
+	else
+		queue_work(usb_wq, &ra->work);
+}
+
+static struct wrap_readahead *wrap_readahead_pipe(struct wrap_device *wd,
+						  unsigned int ep)
+{
+	if (!wd->usb.readahead)
+		return NULL;
+	return &wd->usb.readahead[ep & USB_ENDPOINT_NUMBER_MASK];
+}
+
+wstdcall void wrap_readahead_cancel_irp(struct device_object *dev_obj,
+					struct irp *irp)
+{
+	struct wrap_readahead *ra;
+	union nt_urb *nt_urb = IRP_URB(irp);
+	unsigned long flags;
+
+	/* NB: this function is called holding Cancel spinlock */
+	USBENTER("irp: %p", irp);
+	IoReleaseCancelSpinLock(irp->cancel_irql);
+	ra = wrap_readahead_pipe(IRP_WRAP_DEVICE(irp),
+				 nt_urb->bulk_int_transfer.pipe_handle->
+				 bEndpointAddress);
+	/* IoCancelIrp still uses IRP after this returns, so it is
+	 * completed by worker */
+	spin_lock_irqsave(&ra->lock, flags);
+	RemoveEntryList(&irp->tail.overlay.list);
+	InsertTailList(&ra->canceled, &irp->tail.overlay.list);
+	spin_unlock_irqrestore(&ra->lock, flags);
+	queue_work(usb_wq, &ra->work);
+}
+WIN_FUNC_DECL(wrap_readahead_cancel_irp,2)
+
+static USBD_STATUS wrap_readahead_trans(struct irp *irp,
+					struct wrap_readahead *ra,
+					unsigned int pipe)
+{
+	struct wrap_readahead_buf *rb;
+	union nt_urb *nt_urb = IRP_URB(irp);
+	unsigned long flags;
+	int status;
+
+	irp->io_status.info = 0;
+	spin_lock_irqsave(&ra->lock, flags);
+	if (ra->buf_size == 0) {
+		/* buffers are as big as the driver's reads */
+		ra->pipe = pipe;
+		ra->buf_size = nt_urb->bulk_int_transfer.transfer_buffer_length;
+	}
+	if (!IsListEmpty(&ra->ready) && IsListEmpty(&ra->irps)) {
+		ra->hits++;
+		rb = container_of(ra->ready.next, struct wrap_readahead_buf,
+				  list);
+		status = wrap_readahead_copy(ra, rb, irp);
+		wrap_readahead_restart(ra);
+		spin_unlock_irqrestore(&ra->lock, flags);
+		wrap_readahead_fill(ra);
+		if (status)
+			NT_URB_STATUS(nt_urb) = wrap_urb_status(status);
+		else
+			NT_URB_STATUS(nt_urb) = USBD_STATUS_SUCCESS;
+		USBEXIT(return NT_URB_STATUS(nt_urb));
+	}
+	ra->misses++;
+	wrap_readahead_restart(ra);
+	irp->cancel_routine = WIN_FUNC_PTR(wrap_readahead_cancel_irp,2);
+	smp_mb();
+	/* IRP may have been canceled before cancel routine was set;
+	 * this is checked before IRP is queued, as once it is queued
+	 * and ra->lock is released, it may be completed (and freed) */
+	if (irp->cancel && xchg(&irp->cancel_routine, NULL)) {
+		spin_unlock_irqrestore(&ra->lock, flags);
+		NT_URB_STATUS(nt_urb) = USBD_STATUS_CANCELED;
+		USBEXIT(return NT_URB_STATUS(nt_urb));
+	}
+	/* if cancel routine has been taken by IoCancelIrp, it waits
+	 * for ra->lock and completes IRP from the queue */
+	irp->io_status.status = STATUS_PENDING;
+	NT_URB_STATUS(nt_urb) = USBD_STATUS_PENDING;
+	IoMarkIrpPending(irp);
+	InsertTailList(&ra->irps, &irp->tail.overlay.list);
+	spin_unlock_irqrestore(&ra->lock, flags);
+	/* IRP must not be touched after this */
+	wrap_readahead_process(ra);
+	USBEXIT(return USBD_STATUS_PENDING);
+}
+
+/* whether read on bulk-in pipe should go through read-ahead; once
+ * buffers are in use, reads continue to use them until drained, so
+ * data is not reordered when depth is changed */
+static struct wrap_readahead *wrap_use_readahead(struct wrap_device *wd,
+						 unsigned int ep)
+{
+	struct wrap_readahead *ra;
+	unsigned long flags;
+	BOOLEAN active;
+
+	ra = wrap_readahead_pipe(wd, ep);
+	if (!ra)
+		return NULL;
+	if (wd->usb.readahead_depth > 0)
+		return ra;
+	spin_lock_irqsave(&ra->lock, flags);
+	active = ra->submitted || ra->num_ready || !IsListEmpty(&ra->irps);
+	spin_unlock_irqrestore(&ra->lock, flags);
+	return active ? ra : NULL;
+}
+
+/* discard read-ahead data and fail pending reads on endpoint 'ep' */
+static void wrap_readahead_abort(struct wrap_device *wd, unsigned int ep)
+{
+	struct wrap_readahead *ra;
+	struct wrap_readahead_buf *rb;
+	struct nt_list *ent, *next;
+	struct irp *irp;
+	unsigned long flags;
+
+	ra = wrap_readahead_pipe(wd, ep);
+	if (!ra)
+		return;
+	spin_lock_irqsave(&ra->lock, flags);
+	if (ra->num_bufs == 0 && IsListEmpty(&ra->irps)) {
+		spin_unlock_irqrestore(&ra->lock, flags);
+		return;
+	}
+	ra->stopped = TRUE;
+	while ((ent = RemoveHeadList(&ra->ready)))
+		InsertTailList(&ra->idle, ent);
+	ra->num_ready = 0;
+	nt_list_for_each_safe(ent, next, &ra->irps) {
+		irp = container_of(ent, struct irp, tail.overlay.list);
+		RemoveEntryList(ent);
+		InitializeListHead(ent);
+		/* IRP already being canceled is left to cancel routine */
+		if (xchg(&irp->cancel_routine, NULL))
+			InsertTailList(&ra->canceled, ent);
+	}
+	/* completion may run before usb_unlink_urb returns, so lock
+	 * is dropped around it; buffers are removed from list only
+	 * when device is removed */
+	nt_list_for_each_entry(rb, &ra->bufs, all_list) {
+		spin_unlock_irqrestore(&ra->lock, flags);
+		usb_unlink_urb(rb->urb);
+		spin_lock_irqsave(&ra->lock, flags);
+	}
+	spin_unlock_irqrestore(&ra->lock, flags);
+	queue_work(usb_wq, &ra->work);
+}
+
+int wrap_readahead_set_depth(struct wrap_device *wd, int depth)
+{
+	int i;
+
+	if (!wd->usb.readahead || depth < 0 || depth > MAX_READAHEAD_DEPTH)
+		return -EINVAL;
+	wd->usb.readahead_depth = depth;
+	/* pipes that have been read from start reading ahead now */
+	for (i = 0; i < READAHEAD_PIPES; i++) {
+		if (wd->usb.readahead[i].buf_size)
+			wrap_readahead_fill(&wd->usb.readahead[i]);
+	}
+	return 0;
+}
+
+static void wrap_readahead_init(struct wrap_device *wd)
+{
+	struct wrap_readahead *ra;
+	int i;
+
+	wd->usb.readahead_depth = 0;
+	wd->usb.readahead = kzalloc(READAHEAD_PIPES *
+				    sizeof(*wd->usb.readahead), GFP_KERNEL);
+	if (!wd->usb.readahead) {
+		WARNING("couldn't allocate read-ahead state");
+		return;
+	}
+	for (i = 0; i < READAHEAD_PIPES; i++) {
+		ra = &wd->usb.readahead[i];
+		ra->wd = wd;
+		spin_lock_init(&ra->lock);
+		InitializeListHead(&ra->bufs);
+		InitializeListHead(&ra->ready);
+		InitializeListHead(&ra->idle);
+		InitializeListHead(&ra->irps);
+		InitializeListHead(&ra->canceled);
+		INIT_WORK(&ra->work, wrap_readahead_worker);
+	}
+}
+
+/* stop read-ahead on all pipes; called in process context before
+ * device is removed */
+static void wrap_readahead_stop(struct wrap_device *wd)
+{
+	struct wrap_readahead_buf *rb;
+	struct wrap_readahead *ra;
+	unsigned long flags;
+	int i;
+
+	if (!wd->usb.readahead)
+		return;
+	wd->usb.readahead_depth = 0;
+	for (i = 0; i < READAHEAD_PIPES; i++) {
+		ra = &wd->usb.readahead[i];
+		if (ra->num_bufs == 0 && IsListEmpty(&ra->irps))
+			continue;
+		wrap_readahead_abort(wd, i);
+		/* with depth 0 no more urbs are submitted */
+		spin_lock_irqsave(&ra->lock, flags);
+		nt_list_for_each_entry(rb, &ra->bufs, all_list) {
+			spin_unlock_irqrestore(&ra->lock, flags);
+			usb_kill_urb(rb->urb);
+			spin_lock_irqsave(&ra->lock, flags);
 		}
-		wrap_free_urb(urb);
-		IoCompleteRequest(irp, IO_NO_INCREMENT);
+		spin_unlock_irqrestore(&ra->lock, flags);
 	}
-	USBEXIT(return);
+}
+
+static void wrap_readahead_exit(struct wrap_device *wd)
+{
+	struct wrap_readahead_buf *rb;
+	struct wrap_readahead *ra;
+	struct nt_list *ent;
+	int i;
+
+	if (!wd->usb.readahead)
+		return;
+	for (i = 0; i < READAHEAD_PIPES; i++) {
+		ra = &wd->usb.readahead[i];
+		while ((ent = RemoveHeadList(&ra->bufs))) {
+			rb = container_of(ent, struct wrap_readahead_buf,
+					  all_list);
+			kfree(rb->urb->transfer_buffer);
+			usb_free_urb(rb->urb);
+			kfree(rb);
+		}
+	}
+	kfree(wd->usb.readahead);
+	wd->usb.readahead = NULL;
 }
 
 static USBD_STATUS wrap_bulk_or_intr_trans(struct irp *irp)
@@ -484,6 +1350,7 @@ static USBD_STATUS wrap_bulk_or_intr_trans(struct irp *irp)
 	unsigned int pipe;
 	struct usbd_bulk_or_intr_transfer *bulk_int_tx;
 	USBD_STATUS status;
+	struct wrap_readahead *ra;
 	struct wrap_device *wd = IRP_WRAP_DEVICE(irp);
 	struct usb_device *udev = wd->usb.udev;
 	union nt_urb *nt_urb = IRP_URB(irp);
@@ -512,8 +1379,12 @@ static USBD_STATUS wrap_bulk_or_intr_trans(struct irp *irp)
 	}
 
 	DUMP_IRP(irp);
+	if (usb_pipebulk(pipe) && usb_pipein(pipe) &&
+	    bulk_int_tx->transfer_buffer_length &&
+	    (ra = wrap_use_readahead(wd, pipe_handle->bEndpointAddress)))
+		return wrap_readahead_trans(irp, ra, pipe);
 	urb = wrap_alloc_urb(irp, pipe, bulk_int_tx->transfer_buffer,
-			     bulk_int_tx->transfer_buffer_length);
+			     bulk_int_tx->transfer_buffer_length, 0);
 	if (!urb) {
 		ERROR("couldn't allocate urb");
 		return USBD_STATUS_NO_MEMORY;
@@ -543,6 +1414,80 @@ static USBD_STATUS wrap_bulk_or_intr_trans(struct irp *irp)
 	USBEXIT(return status);
 }
 
+static USBD_STATUS wrap_isoch_trans(struct irp *irp)
+{
+	struct usb_endpoint_descriptor *pipe_handle;
+	struct usbd_isochronous_transfer *iso_tx;
+	struct urb *urb;
+	unsigned int pipe, offset, next;
+	int i, n, interval;
+	USBD_STATUS status;
+	struct wrap_device *wd = IRP_WRAP_DEVICE(irp);
+	struct usb_device *udev = wd->usb.udev;
+	union nt_urb *nt_urb = IRP_URB(irp);
+
+	iso_tx = &nt_urb->isochronous;
+	pipe_handle = iso_tx->pipe_handle;
+	n = iso_tx->number_of_packets;
+	USBTRACE("flags: 0x%x, length: %u, buffer: %p, handle: %p, "
+		 "packets: %d, frame: %u", iso_tx->transfer_flags,
+		 iso_tx->transfer_buffer_length, iso_tx->transfer_buffer,
+		 pipe_handle, n, iso_tx->start_frame);
+	if ((pipe_handle->bmAttributes & USB_ENDPOINT_XFERTYPE_MASK) !=
+	    USB_ENDPOINT_XFER_ISOC) {
+		WARNING("invalid pipe %d", pipe_handle->bEndpointAddress);
+		return USBD_STATUS_INVALID_PIPE_HANDLE;
+	}
+	if (n <= 0 || n > MAX_ISO_PACKETS) {
+		WARNING("invalid number of packets: %d", n);
+		return USBD_STATUS_INVALID_PARAMETER;
+	}
+	if (iso_tx->transfer_flags & USBD_TRANSFER_DIRECTION_IN)
+		pipe = usb_rcvisocpipe(udev, pipe_handle->bEndpointAddress);
+	else
+		pipe = usb_sndisocpipe(udev, pipe_handle->bEndpointAddress);
+
+	DUMP_IRP(irp);
+	urb = wrap_alloc_urb(irp, pipe, iso_tx->transfer_buffer,
+			     iso_tx->transfer_buffer_length, n);
+	if (!urb) {
+		ERROR("couldn't allocate urb");
+		return USBD_STATUS_NO_MEMORY;
+	}
+	urb->dev = udev;
+	urb->pipe = pipe;
+	urb->complete = wrap_urb_complete;
+	urb->number_of_packets = n;
+	/* isochronous bInterval is exponent in (micro)frames */
+	interval = clamp_t(int, pipe_handle->bInterval, 1, 16);
+	urb->interval = 1 << (interval - 1);
+	if (iso_tx->transfer_flags & USBD_START_ISO_TRANSFER_ASAP)
+		urb->transfer_flags |= URB_ISO_ASAP;
+	else
+		urb->start_frame = iso_tx->start_frame;
+	/* packet lengths are given by offsets of consecutive packets,
+	 * as in Windows */
+	for (i = 0; i < n; i++) {
+		offset = iso_tx->iso_packet[i].offset;
+		if (i < n - 1)
+			next = iso_tx->iso_packet[i + 1].offset;
+		else
+			next = iso_tx->transfer_buffer_length;
+		if (next < offset || next > iso_tx->transfer_buffer_length) {
+			WARNING("invalid packet %d: %u, %u", i, offset, next);
+			wrap_free_urb(urb);
+			return USBD_STATUS_INVALID_PARAMETER;
+		}
+		urb->iso_frame_desc[i].offset = offset;
+		urb->iso_frame_desc[i].length = next - offset;
+	}
+	USBTRACE("submitting iso urb %p on pipe 0x%x (ep 0x%x), intvl: %d",
+		 urb, urb->pipe, pipe_handle->bEndpointAddress, urb->interval);
+	status = wrap_submit_urb(irp);
+	USBTRACE("status: %08X", status);
+	USBEXIT(return status);
+}
+
 static USBD_STATUS wrap_vendor_or_class_req(struct irp *irp)
 {
 	u8 req_type;
@@ -606,7 +1551,7 @@ static USBD_STATUS wrap_vendor_or_class_req(struct irp *irp)
 		USBTRACE("pipe: %x, dir out", pipe);
 	}
 	urb = wrap_alloc_urb(irp, pipe, vc_req->transfer_buffer,
-			     vc_req->transfer_buffer_length);
+			     vc_req->transfer_buffer_length, 0);
 	if (!urb) {
 		ERROR("couldn't allocate urb");
 		return USBD_STATUS_NO_MEMORY;
@@ -698,6 +1643,8 @@ static USBD_STATUS wrap_abort_pipe(struct usb_device *udev, struct irp *irp)
 		}
 	}
 	IoReleaseCancelSpinLock(irql);
+	if (pipe_handle->bEndpointAddress & USB_DIR_IN)
+		wrap_readahead_abort(wd, pipe_handle->bEndpointAddress);
 	NT_URB_STATUS(nt_urb) = USBD_STATUS_CANCELED;
 	USBEXIT(return USBD_STATUS_SUCCESS);
 }
@@ -863,7 +1810,7 @@ static USBD_STATUS wrap_select_configuration(struct wrap_device *wd,
 					     union nt_urb *nt_urb,
 					     struct irp *irp)
 {
-	int i, ret;
+	int i, ret, num_pipes;
 	struct usbd_select_configuration *sel_conf;
 	struct usb_device *udev;
 	struct usbd_interface_information *intf;
@@ -894,6 +1841,7 @@ static USBD_STATUS wrap_select_configuration(struct wrap_device *wd,
 	}
 	sel_conf->handle = udev->actconfig;
 	intf = &sel_conf->intf;
+	num_pipes = 0;
 	for (i = 0; i < config->bNumInterfaces && intf->bLength > 0;
 	     i++, intf = (((void *)intf) + intf->bLength)) {
 
@@ -912,7 +1860,9 @@ static USBD_STATUS wrap_select_configuration(struct wrap_device *wd,
 		}
 		USBTRACE("intf: %p, num ep: %d", intf, intf->bNumEndpoints);
 		set_intf_pipe_info(wd, usb_intf, intf);
+		num_pipes += intf->bNumEndpoints;
 	}
+	wrap_prealloc_urbs(wd, num_pipes * URBS_PER_PIPE);
 	return USBD_STATUS_SUCCESS;
 }
 
@@ -1027,6 +1977,11 @@ static USBD_STATUS wrap_process_nt_urb(struct irp *irp)
 		status = wrap_bulk_or_intr_trans(irp);
 		break;
 
+	case URB_FUNCTION_ISOCH_TRANSFER:
+		USBTRACE("submitting isoch irp: %p", irp);
+		status = wrap_isoch_trans(irp);
+		break;
+
 	case URB_FUNCTION_VENDOR_DEVICE:
 	case URB_FUNCTION_VENDOR_INTERFACE:
 	case URB_FUNCTION_VENDOR_ENDPOINT:
@@ -1404,12 +2359,33 @@ wstdcall NTSTATUS USBD_InterfaceQueryBusTime(void *context, ULONG *frame)
 	USBEXIT(return STATUS_SUCCESS);
 }
 
+/* submits isochronous urb without an IRP from the driver; an IRP is
+ * allocated here and freed when the urb completes */
 wstdcall NTSTATUS USBD_InterfaceSubmitIsoOutUrb(void *context,
 					       union nt_urb *nt_urb)
 {
-	/* TODO: implement this */
-	TODO();
-	USBEXIT(return STATUS_NOT_IMPLEMENTED);
+	struct wrap_device *wd = context;
+	struct io_stack_location *irp_sl;
+	struct irp *irp;
+	NTSTATUS status;
+
+	USBENTER("%p, %p", wd, nt_urb);
+	if (nt_urb->header.function != URB_FUNCTION_ISOCH_TRANSFER) {
+		WARNING("invalid function: %x", nt_urb->header.function);
+		USBEXIT(return STATUS_INVALID_PARAMETER);
+	}
+	irp = IoAllocateIrp(wd->pdo->stack_count, FALSE);
+	if (!irp)
+		USBEXIT(return STATUS_NO_MEMORY);
+	irp_sl = IoGetNextIrpStackLocation(irp);
+	irp_sl->major_fn = IRP_MJ_INTERNAL_DEVICE_CONTROL;
+	irp_sl->params.dev_ioctl.code = IOCTL_INTERNAL_USB_SUBMIT_URB;
+	irp_sl->params.others.arg1 = nt_urb;
+	status = IoCallDriver(wd->pdo, irp);
+	USBTRACE("status: %08X", status);
+	if (status == STATUS_PENDING)
+		status = STATUS_SUCCESS;
+	USBEXIT(return status);
 }
 
 wstdcall NTSTATUS
@@ -1468,6 +2444,11 @@ usb_query_interface(struct wrap_device *wd, struct io_stack_location *irp_sl)
 
 int usb_init(void)
 {
+	usb_wq = create_workqueue("usb_wq");
+	if (!usb_wq) {
+		WARNING("couldn't create usb_wq threads");
+		return -ENOMEM;
+	}
 	InitializeListHead(&wrap_urb_complete_list);
 	spin_lock_init(&wrap_urb_complete_list_lock);
 	INIT_WORK(&wrap_urb_complete_work, wrap_urb_complete_worker);
@@ -1479,18 +2460,61 @@ int usb_init(void)
 
 void usb_exit(void)
 {
+	if (usb_wq)
+		destroy_workqueue(usb_wq);
 	USBEXIT(return);
 }
 
 int usb_init_device(struct wrap_device *wd)
 {
+	struct wrap_urb_complete_queue *queue;
+	int i;
+
 	InitializeListHead(&wd->usb.wrap_urb_list);
 	wd->usb.num_alloc_urbs = 0;
+	wd->usb.max_alloc_urbs = MAX_ALLOCATED_URBS;
+	InitializeListHead(&wd->usb.free_urbs);
+	spin_lock_init(&wd->usb.free_urbs_lock);
+	wd->usb.complete_queues =
+		kmalloc(URB_COMPLETE_QUEUES * sizeof(*wd->usb.complete_queues),
+			GFP_KERNEL);
+	if (wd->usb.complete_queues) {
+		for (i = 0; i < URB_COMPLETE_QUEUES; i++) {
+			queue = &wd->usb.complete_queues[i];
+			spin_lock_init(&queue->lock);
+			InitializeListHead(&queue->list);
+			queue->busy = FALSE;
+			INIT_WORK(&queue->work, wrap_urb_complete_queue_worker);
+		}
+	} else
+		WARNING("couldn't allocate completion queues; "
+			"using global queue");
+	wd->usb.dma_bufs = kmalloc(DMA_BUF_CACHES * sizeof(*wd->usb.dma_bufs),
+				   GFP_KERNEL);
+	if (wd->usb.dma_bufs) {
+		for (i = 0; i < DMA_BUF_CACHES; i++) {
+			spin_lock_init(&wd->usb.dma_bufs[i].lock);
+			InitializeListHead(&wd->usb.dma_bufs[i].bufs);
+			wd->usb.dma_bufs[i].count = 0;
+		}
+	}
+	wrap_readahead_init(wd);
 	USBEXIT(return 0);
 }
 
 void usb_exit_device(struct wrap_device *wd)
 {
+	wrap_readahead_stop(wd);
+	flush_workqueue(usb_wq);
 	kill_all_urbs(wd, 0);
+	if (wd->usb.complete_queues) {
+		flush_workqueue(usb_wq);
+		kfree(wd->usb.complete_queues);
+		wd->usb.complete_queues = NULL;
+	}
+	wrap_free_dma_bufs(wd);
+	kfree(wd->usb.dma_bufs);
+	wd->usb.dma_bufs = NULL;
+	wrap_readahead_exit(wd);
 	USBEXIT(return);
 }
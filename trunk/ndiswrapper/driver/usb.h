@@ -351,10 +351,42 @@ struct usbd_idle_callback {
 
 #define NT_URB_STATUS(nt_urb) ((nt_urb)->header.status)
 
+/* with read-ahead enabled, up to 'readahead_depth' urbs are kept
+ * submitted on each bulk-in pipe and read IRPs are satisfied from
+ * the data they have already received */
+#define READAHEAD_PIPES		16
+#define MAX_READAHEAD_DEPTH	64
+
+struct wrap_readahead {
+	struct wrap_device *wd;
+	spinlock_t lock;
+	unsigned int pipe;
+	unsigned int buf_size;
+	/* all buffers allocated for this pipe */
+	struct nt_list bufs;
+	/* buffers with received data (or error) not yet consumed */
+	struct nt_list ready;
+	/* buffers neither submitted nor holding data */
+	struct nt_list idle;
+	/* IRPs waiting for data */
+	struct nt_list irps;
+	/* IRPs canceled, to be completed by worker */
+	struct nt_list canceled;
+	int num_bufs;
+	int submitted;
+	int num_ready;
+	BOOLEAN stopped;
+	BOOLEAN processing;
+	struct work_struct work;
+	unsigned long hits;
+	unsigned long misses;
+};
+
 NTSTATUS wrap_submit_irp(struct device_object *pdo, struct irp *irp);
 void wrap_suspend_urbs(struct wrap_device *wd);
 void wrap_resume_urbs(struct wrap_device *wd);
 NTSTATUS usb_query_interface(struct wrap_device *wd,
 			     struct io_stack_location *irp_sl);
+int wrap_readahead_set_depth(struct wrap_device *wd, int depth);
 
 #endif /* USB_H */
@@ -234,6 +234,20 @@ struct nt_list {
 
 typedef ULONG_PTR NT_SPIN_LOCK;
 
+/* queue entry of an in-stack queued spinlock; 'lock' is the address
+ * of the spinlock, with LOCK_QUEUE_WAIT set while waiting for it */
+struct kspin_lock_queue {
+	struct kspin_lock_queue *volatile next;
+	NT_SPIN_LOCK *volatile lock;
+};
+
+#define LOCK_QUEUE_WAIT 1
+
+struct klock_queue_handle {
+	struct kspin_lock_queue lock_queue;
+	KIRQL old_irql;
+};
+
 enum kdpc_importance {LowImportance, MediumImportance, HighImportance};
 
 struct kdpc;
@@ -1005,9 +1019,15 @@ struct wrap_urb {
 	struct nt_list list;
 	enum urb_state state;
 	struct nt_list complete_list;
+	struct nt_list free_list;
 	unsigned int flags;
 	struct urb *urb;
 	struct irp *irp;
+	/* bounce buffer, if WRAP_URB_COPY_BUFFER is set */
+	struct wrap_dma_buf *dma_buf;
+	/* scatterlist for vmalloc'ed transfer buffers */
+	struct scatterlist *sg;
+	unsigned int sg_size;
 #ifdef USB_DEBUG
 	unsigned int id;
 #endif
@@ -1189,10 +1209,17 @@ enum nt_obj_type {
 enum common_object_type {
 	OBJECT_TYPE_NONE, OBJECT_TYPE_DEVICE, OBJECT_TYPE_DRIVER,
 	OBJECT_TYPE_NT_THREAD, OBJECT_TYPE_FILE, OBJECT_TYPE_CALLBACK,
+	OBJECT_TYPE_MAX,
 };
 
 struct common_object_header {
 	struct nt_list list;
+	/* threads are hashed by task and named objects by name, in
+	 * table of their type */
+	struct list_head hash_list;
+	struct rcu_head rcu;
+	u32 name_hash;
+	BOOLEAN hashed;
 	enum common_object_type type;
 	UINT size;
 	UINT ref_count;
@@ -111,13 +111,17 @@ out:
 	return 0;
 }
 
-static int wrap_queue_work_on(struct workqueue_struct *workq,
-			      struct work_struct *work, int cpu)
+int wrap_queue_work_on(struct workqueue_struct *workq,
+		       struct work_struct *work, int cpu)
 {
-	struct workqueue_thread *thread = &workq->threads[cpu];
+	struct workqueue_thread *thread;
 	unsigned long flags;
 	int ret;
 
+	if (workq->singlethread || cpu >= workq->num_cpus ||
+	    !workq->threads[cpu].pid)
+		cpu = 0;
+	thread = &workq->threads[cpu];
 	assert(thread->pid > 0);
 	DBG_BLOCK(4) {
 		WORKTRACE("%p, %d", workq, cpu);
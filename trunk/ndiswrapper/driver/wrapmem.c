@@ -15,6 +15,7 @@
 
 #define _WRAPMEM_C_
 
+#include <linux/hash.h>
 #include "ntoskernel.h"
 #include "wrapmem.h"
 
@@ -266,34 +267,346 @@ void wrap_free_pages(unsigned long ptr, int order)
 	free_pages((unsigned long)info, get_order(info->size));
 }
 
-#if ALLOC_DEBUG > 1
-void *wrap_ExAllocatePoolWithTag(enum pool_type pool_type, SIZE_T size,
-				 ULONG tag, const char *file, int line)
+int alloc_size(enum alloc_type type)
 {
+	if ((int)type >= 0 && type < ALLOC_TYPE_MAX)
+		return atomic_read(&alloc_sizes[type]);
+	else
+		return -EINVAL;
+}
+
+#endif // ALLOC_DEBUG
+
+/* pool (ExAllocatePoolWithTag) allocations: small blocks come from
+ * size class caches (or kmalloc, if bigger than largest class) and
+ * are preceded by pool_hdr; blocks of a page or more are page aligned
+ * (as on Windows), allocated from linear map with __get_free_pages
+ * (backed by large pages) if possible and tracked in pool_large_hash,
+ * as there is no room for a header. vmalloc is used only for big
+ * blocks in non-atomic context, when pages can't be allocated */
+
+#define POOL_MIN_CLASS_SHIFT 5
+#define POOL_NR_CLASSES 7
+#define POOL_MAX_CLASS_SIZE (1 << (POOL_MIN_CLASS_SHIFT + POOL_NR_CLASSES - 1))
+#define POOL_CLASS_KMALLOC 0xff
+#define POOL_MAGIC 0x5057
+/* don't try harder than this order in atomic context */
+#define POOL_MAX_ATOMIC_ORDER 4
+
+#if LINUX_VERSION_CODE >= KERNEL_VERSION(4,4,0)
+#define gfp_can_sleep(flags) gfpflags_allow_blocking(flags)
+#else
+#define gfp_can_sleep(flags) ((flags) & __GFP_WAIT)
+#endif
+
+struct pool_hdr {
+	union {
+		struct {
+			struct pool_tag *tag;
+			u32 size;
+			u8 class;
+			u8 reserved;
+			u16 magic;
+		};
+		/* keep blocks 16 byte aligned */
+		u8 pad[16];
+	};
+};
+
+struct pool_large {
+	struct nt_list list;
 	void *addr;
-	struct alloc_info *info;
+	struct pool_tag *tag;
+	SIZE_T size;
+	/* -1 if vmalloc'ed */
+	int order;
+};
 
-	ENTER4("pool_type: %d, size: %zu, tag: %u", pool_type, size, tag);
-	addr = (ExAllocatePoolWithTag)(pool_type, size, tag);
-	if (!addr)
+static const char *pool_cache_names[POOL_NR_CLASSES] = {
+	DRIVER_NAME "_pool_32", DRIVER_NAME "_pool_64",
+	DRIVER_NAME "_pool_128", DRIVER_NAME "_pool_256",
+	DRIVER_NAME "_pool_512", DRIVER_NAME "_pool_1024",
+	DRIVER_NAME "_pool_2048",
+};
+static void *pool_caches[POOL_NR_CLASSES];
+/* older kernels don't copy cache names; caches with leaked blocks
+ * are not destroyed, so their names must outlive module */
+static char *pool_cache_name_copies[POOL_NR_CLASSES];
+
+#define POOL_HASH_BITS 6
+static struct nt_list pool_large_hash[1 << POOL_HASH_BITS];
+static spinlock_t pool_large_lock;
+
+struct list_head pool_tag_list;
+static struct list_head pool_tag_hash[1 << POOL_HASH_BITS];
+static spinlock_t pool_tag_lock;
+/* used if memory for a new tag can't be allocated */
+static struct pool_tag pool_tag_other;
+
+static struct pool_tag *get_pool_tag(ULONG tag)
+{
+	struct list_head *head;
+	struct pool_tag *pool_tag, *new;
+	unsigned long flags;
+
+	head = &pool_tag_hash[hash_32(tag, POOL_HASH_BITS)];
+	rcu_read_lock();
+	list_for_each_entry_rcu(pool_tag, head, hash_list) {
+		if (pool_tag->tag == tag) {
+			rcu_read_unlock();
+			return pool_tag;
+		}
+	}
+	rcu_read_unlock();
+
+	new = kzalloc(sizeof(*new), GFP_ATOMIC);
+	spin_lock_irqsave(&pool_tag_lock, flags);
+	list_for_each_entry(pool_tag, head, hash_list) {
+		if (pool_tag->tag == tag) {
+			spin_unlock_irqrestore(&pool_tag_lock, flags);
+			kfree(new);
+			return pool_tag;
+		}
+	}
+	if (new) {
+		new->tag = tag;
+		list_add_rcu(&new->hash_list, head);
+		list_add_tail_rcu(&new->list, &pool_tag_list);
+		pool_tag = new;
+	} else
+		pool_tag = &pool_tag_other;
+	spin_unlock_irqrestore(&pool_tag_lock, flags);
+	return pool_tag;
+}
+
+static void *pool_alloc_large(SIZE_T size, struct pool_tag *tag,
+			      gfp_t flags)
+{
+	struct pool_large *large;
+	unsigned long irq_flags;
+	int order;
+	void *addr;
+
+	large = kmalloc(sizeof(*large), flags);
+	if (!large)
 		return NULL;
-	info = addr - sizeof(*info);
-	info->file = file;
-	info->line = line;
-	info->tag = tag;
-	EXIT4(return addr);
+	order = get_order(size);
+	addr = NULL;
+	if (!gfp_can_sleep(flags)) {
+		if (order <= POOL_MAX_ATOMIC_ORDER)
+			addr = (void *)__get_free_pages(flags | __GFP_NOWARN,
+							order);
+	} else {
+		addr = (void *)__get_free_pages(flags | __GFP_NOWARN |
+						__GFP_NORETRY, order);
+		if (!addr) {
+			addr = vmalloc(size);
+			order = -1;
+		}
+	}
+	if (!addr) {
+		kfree(large);
+		return NULL;
+	}
+	large->addr = addr;
+	large->tag = tag;
+	large->size = size;
+	large->order = order;
+	spin_lock_irqsave(&pool_large_lock, irq_flags);
+	InsertTailList(&pool_large_hash[hash_ptr(addr, POOL_HASH_BITS)],
+		       &large->list);
+	spin_unlock_irqrestore(&pool_large_lock, irq_flags);
+	return addr;
 }
-#endif
 
-int alloc_size(enum alloc_type type)
+static struct pool_large *pool_find_large(void *addr)
 {
-	if ((int)type >= 0 && type < ALLOC_TYPE_MAX)
-		return atomic_read(&alloc_sizes[type]);
+	struct pool_large *large;
+	unsigned long flags;
+	struct nt_list *head;
+
+	head = &pool_large_hash[hash_ptr(addr, POOL_HASH_BITS)];
+	spin_lock_irqsave(&pool_large_lock, flags);
+	nt_list_for_each_entry(large, head, list) {
+		if (large->addr == addr) {
+			RemoveEntryList(&large->list);
+			spin_unlock_irqrestore(&pool_large_lock, flags);
+			return large;
+		}
+	}
+	spin_unlock_irqrestore(&pool_large_lock, flags);
+	return NULL;
+}
+
+static void pool_free_large(struct pool_large *large)
+{
+	if (large->order < 0)
+		vfree(large->addr);
 	else
-		return -EINVAL;
+		free_pages((unsigned long)large->addr, large->order);
+	kfree(large);
 }
 
-#endif // ALLOC_DEBUG
+void *wrap_pool_alloc(SIZE_T size, ULONG tag, gfp_t flags)
+{
+	struct pool_tag *pool_tag;
+	struct pool_hdr *hdr;
+	int class;
+	void *addr;
+
+	pool_tag = get_pool_tag(tag);
+	if (size + sizeof(*hdr) <= POOL_MAX_CLASS_SIZE) {
+		class = 0;
+		while (size + sizeof(*hdr) > (1 << (POOL_MIN_CLASS_SHIFT +
+						    class)))
+			class++;
+		hdr = kmem_cache_alloc(pool_caches[class], flags);
+	} else if (size < PAGE_SIZE) {
+		class = POOL_CLASS_KMALLOC;
+		hdr = kmalloc(size + sizeof(*hdr), flags);
+	} else {
+		addr = pool_alloc_large(size, pool_tag, flags);
+		hdr = NULL;
+		goto out;
+	}
+	if (hdr) {
+		hdr->tag = pool_tag;
+		hdr->size = size;
+		hdr->class = class;
+		hdr->magic = POOL_MAGIC;
+		addr = hdr + 1;
+	} else
+		addr = NULL;
+
+out:
+	if (addr) {
+		atomic_inc(&pool_tag->count);
+		atomic_add(size, &pool_tag->bytes);
+		atomic_inc(&pool_tag->allocs);
+	} else
+		atomic_inc(&pool_tag->failures);
+	return addr;
+}
+
+void wrap_pool_free(void *addr)
+{
+	struct pool_large *large;
+	struct pool_hdr *hdr;
+
+	if (!addr)
+		return;
+	if (!((unsigned long)addr & ~PAGE_MASK)) {
+		large = pool_find_large(addr);
+		if (large) {
+			atomic_dec(&large->tag->count);
+			atomic_sub(large->size, &large->tag->bytes);
+			pool_free_large(large);
+			return;
+		}
+		/* small blocks are never page aligned and header
+		 * may be in a guard page, so don't look at it */
+		ERROR("%p is not allocated from pool", addr);
+		WARN_ON(1);
+		return;
+	}
+	hdr = (struct pool_hdr *)addr - 1;
+	if (hdr->magic != POOL_MAGIC) {
+		/* freeing it with whatever allocator may corrupt
+		 * memory; leak it instead */
+		ERROR("%p is not allocated from pool or already freed",
+		      addr);
+		WARN_ON(1);
+		return;
+	}
+	hdr->magic = 0;
+	atomic_dec(&hdr->tag->count);
+	atomic_sub(hdr->size, &hdr->tag->bytes);
+	if (hdr->class == POOL_CLASS_KMALLOC)
+		kfree(hdr);
+	else
+		kmem_cache_free(pool_caches[hdr->class], hdr);
+}
+
+static int pool_init(void)
+{
+	int i;
+
+	INIT_LIST_HEAD(&pool_tag_list);
+	for (i = 0; i < ARRAY_SIZE(pool_tag_hash); i++)
+		INIT_LIST_HEAD(&pool_tag_hash[i]);
+	spin_lock_init(&pool_tag_lock);
+	/* tag of pool_tag_other is 0, which can also be used by
+	 * drivers; it is shown separately, not looked up */
+	list_add_tail(&pool_tag_other.list, &pool_tag_list);
+	for (i = 0; i < ARRAY_SIZE(pool_large_hash); i++)
+		InitializeListHead(&pool_large_hash[i]);
+	spin_lock_init(&pool_large_lock);
+	for (i = 0; i < POOL_NR_CLASSES; i++) {
+		pool_cache_name_copies[i] = kstrdup(pool_cache_names[i],
+						    GFP_KERNEL);
+		if (!pool_cache_name_copies[i])
+			return -ENOMEM;
+		pool_caches[i] =
+			wrap_kmem_cache_create(pool_cache_name_copies[i],
+					       1 << (POOL_MIN_CLASS_SHIFT + i),
+					       sizeof(struct pool_hdr), 0);
+		if (!pool_caches[i]) {
+			ERROR("couldn't create cache %s",
+			      pool_cache_names[i]);
+			return -ENOMEM;
+		}
+	}
+	return 0;
+}
+
+static void pool_exit(void)
+{
+	struct pool_tag *pool_tag, *next;
+	struct pool_large *large;
+	struct nt_list *ent;
+	int i, leaked;
+
+	list_for_each_entry(pool_tag, &pool_tag_list, list) {
+		if (atomic_read(&pool_tag->count))
+			WARNING("%d bytes in %d blocks with tag 0x%08X "
+				"leaking", atomic_read(&pool_tag->bytes),
+				atomic_read(&pool_tag->count), pool_tag->tag);
+	}
+	for (i = 0; i < ARRAY_SIZE(pool_large_hash); i++) {
+		while ((ent = RemoveHeadList(&pool_large_hash[i]))) {
+			large = container_of(ent, struct pool_large, list);
+			atomic_dec(&large->tag->count);
+			pool_free_large(large);
+		}
+	}
+	/* what is left are small blocks, which can't be found to
+	 * free them; destroying their caches would oops, so leave
+	 * caches (and tags the blocks point to) alone */
+	leaked = 0;
+	list_for_each_entry(pool_tag, &pool_tag_list, list)
+		leaked += atomic_read(&pool_tag->count);
+	if (leaked) {
+		ERROR("%d pool blocks leaked; not destroying pool caches",
+		      leaked);
+		for (i = 0; i < POOL_NR_CLASSES; i++)
+			pool_caches[i] = NULL;
+	}
+	for (i = 0; i < POOL_NR_CLASSES; i++) {
+		if (pool_caches[i]) {
+			kmem_cache_destroy(pool_caches[i]);
+			pool_caches[i] = NULL;
+		}
+		if (!leaked)
+			kfree(pool_cache_name_copies[i]);
+		pool_cache_name_copies[i] = NULL;
+	}
+	list_for_each_entry_safe(pool_tag, next, &pool_tag_list, list) {
+		if (pool_tag != &pool_tag_other &&
+		    !atomic_read(&pool_tag->count))
+			kfree(pool_tag);
+	}
+	INIT_LIST_HEAD(&pool_tag_list);
+}
 
 int wrapmem_init(void)
 {
@@ -302,7 +615,7 @@ int wrapmem_init(void)
 #endif
 	InitializeListHead(&slack_allocs);
 	spin_lock_init(&alloc_lock);
-	return 0;
+	return pool_init();
 }
 
 void wrapmem_exit(void)
@@ -312,6 +625,7 @@ void wrapmem_exit(void)
 #endif
 	struct nt_list *ent;
 
+	pool_exit();
 	/* free all pointers on the slack list */
 	while (1) {
 		struct slack_alloc_info *info;
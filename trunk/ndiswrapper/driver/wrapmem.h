@@ -35,6 +35,24 @@ void *slack_kmalloc(size_t size);
 void *slack_kzalloc(size_t size);
 void slack_kfree(void *ptr);
 
+/* statistics of pool (ExAllocatePoolWithTag) allocations with a tag */
+struct pool_tag {
+	struct list_head list;
+	struct list_head hash_list;
+	ULONG tag;
+	atomic_t count;
+	atomic_t bytes;
+	atomic_t allocs;
+	atomic_t failures;
+};
+
+/* pool tags are never removed until module is unloaded; walk with
+ * rcu_read_lock */
+extern struct list_head pool_tag_list;
+
+void *wrap_pool_alloc(SIZE_T size, ULONG tag, gfp_t flags);
+void wrap_pool_free(void *addr);
+
 #if ALLOC_DEBUG
 enum alloc_type { ALLOC_TYPE_KMALLOC_ATOMIC,
 		  ALLOC_TYPE_KMALLOC_NON_ATOMIC,
@@ -55,13 +73,6 @@ void *wrap_alloc_pages(gfp_t flags, unsigned int size,
 void wrap_free_pages(unsigned long ptr, int order);
 int alloc_size(enum alloc_type type);
 
-#if ALLOC_DEBUG > 1
-void *wrap_ExAllocatePoolWithTag(enum pool_type pool_type, SIZE_T size,
-				 ULONG tag, const char *file, int line);
-#define ExAllocatePoolWithTag(pool_type, size, tag)			\
-	wrap_ExAllocatePoolWithTag(pool_type, size, tag, __FILE__, __LINE__)
-#endif
-
 #ifndef _WRAPMEM_C_
 #undef kmalloc
 #undef kzalloc
@@ -42,6 +42,22 @@ static void set_multicast_list(struct ndis_device *wnd);
 static int ndis_net_dev_open(struct net_device *net_dev);
 static int ndis_net_dev_close(struct net_device *net_dev);
 
+/* tx_ring_mutex serializes tx_worker with reset, suspend and resizing
+ * of ring; since tx_skbuff can't take a mutex when sending directly,
+ * the consumer of tx_ring also owns TX_RING_BUSY bit */
+static void lock_tx_ring(struct ndis_device *wnd)
+{
+	mutex_lock(&wnd->tx_ring_mutex);
+	while (test_and_set_bit(TX_RING_BUSY, &wnd->tx_ring_busy))
+		cpu_relax();
+}
+
+static void unlock_tx_ring(struct ndis_device *wnd)
+{
+	clear_bit(TX_RING_BUSY, &wnd->tx_ring_busy);
+	mutex_unlock(&wnd->tx_ring_mutex);
+}
+
 /* MiniportReset */
 NDIS_STATUS mp_reset(struct ndis_device *wnd)
 {
@@ -51,7 +67,7 @@ NDIS_STATUS mp_reset(struct ndis_device *wnd)
 	KIRQL irql;
 
 	ENTER2("wnd: %p", wnd);
-	mutex_lock(&wnd->tx_ring_mutex);
+	lock_tx_ring(wnd);
 	mutex_lock(&wnd->ndis_req_mutex);
 	mp = &wnd->wd->driver->ndis_driver->mp;
 	prepare_wait_condition(wnd->ndis_req_task, wnd->ndis_req_done, 0);
@@ -78,7 +94,7 @@ NDIS_STATUS mp_reset(struct ndis_device *wnd)
 		set_packet_filter(wnd, wnd->packet_filter);
 		set_multicast_list(wnd);
 	}
-	mutex_unlock(&wnd->tx_ring_mutex);
+	unlock_tx_ring(wnd);
 	EXIT3(return res);
 }
 
@@ -264,6 +280,8 @@ static void mp_halt(struct ndis_device *wnd)
 		mutex_lock(&wnd->ndis_req_mutex);
 	}
 #endif
+	/* return packets still queued before halting */
+	flush_work(&wnd->return_work);
 	mp = &wnd->wd->driver->ndis_driver->mp;
 	TRACE1("halt: %p", mp->mp_halt);
 	LIN2WIN1(mp->mp_halt, wnd->nmb->mp_ctx);
@@ -273,31 +291,26 @@ static void mp_halt(struct ndis_device *wnd)
 		NdisMDeregisterInterrupt(wnd->mp_interrupt);
 	/* cancel any timers left by buggy windows driver; also free
 	 * the memory for timers */
-	while (1) {
-		struct nt_slist *slist;
-		struct wrap_timer *wrap_timer;
-
-		spin_lock_bh(&ntoskernel_lock);
-		if ((slist = wnd->wrap_timer_slist.next))
-			wnd->wrap_timer_slist.next = slist->next;
-		spin_unlock_bh(&ntoskernel_lock);
-		TIMERTRACE("%p", slist);
-		if (!slist)
-			break;
-		wrap_timer = container_of(slist, struct wrap_timer, slist);
-		wrap_timer->repeat = 0;
-		/* ktimer that this wrap_timer is associated to can't
-		 * be touched, as it may have been freed by the driver
-		 * already */
-		if (del_timer_sync(&wrap_timer->timer))
-			WARNING("Buggy Windows driver left timer %p "
-				"running", wrap_timer->nt_timer);
-		memset(wrap_timer, 0, sizeof(*wrap_timer));
-		kfree(wrap_timer);
-	}
+	free_wrap_timers(&wnd->timer_table);
 	EXIT1(return);
 }
 
+/* slack (in ns) of timers of this device; takes effect when a timer
+ * is set next time */
+void set_timer_slack(struct ndis_device *wnd, unsigned long slack)
+{
+	struct wrap_timer_table *table = &wnd->timer_table;
+	struct wrap_timer *wrap_timer;
+	int i;
+
+	spin_lock_bh(&table->lock);
+	wnd->timer_slack = slack;
+	for (i = 0; i < ARRAY_SIZE(table->buckets); i++)
+		nt_list_for_each_entry(wrap_timer, &table->buckets[i], list)
+			wrap_timer->slack = slack;
+	spin_unlock_bh(&table->lock);
+}
+
 static NDIS_STATUS mp_set_power_state(struct ndis_device *wnd,
 				      enum ndis_power_state state)
 {
@@ -328,7 +341,7 @@ static NDIS_STATUS mp_set_power_state(struct ndis_device *wnd,
 			pci_enable_wake(wnd->wd->pci.pdev, PCI_D3cold, 0);
 		}
 		if (status == NDIS_STATUS_SUCCESS) {
-			mutex_unlock(&wnd->tx_ring_mutex);
+			unlock_tx_ring(wnd);
 			netif_device_attach(wnd->net_dev);
 			hangcheck_add(wnd);
 			add_iw_stats_timer(wnd);
@@ -337,7 +350,7 @@ static NDIS_STATUS mp_set_power_state(struct ndis_device *wnd,
 				" resumed", wnd->net_dev->name, state);
 		EXIT1(return status);
 	} else {
-		mutex_lock(&wnd->tx_ring_mutex);
+		lock_tx_ring(wnd);
 		netif_device_detach(wnd->net_dev);
 		hangcheck_del(wnd);
 		del_iw_stats_timer(wnd);
@@ -573,7 +586,7 @@ void free_tx_packet(struct ndis_device *wnd, struct ndis_packet *packet,
 	pool = packet->private.pool;
 	NdisFreePacket(packet);
 	if (netif_queue_stopped(wnd->net_dev) &&
-	    ((pool->max_descr - pool->num_used_descr) >=
+	    ((pool->max_descr - NdisPacketPoolUsage(pool)) >=
 	     (wnd->max_tx_packets / 4))) {
 		set_bit(NETIF_WAKEQ, &wnd->ndis_pending_work);
 		queue_work(wrapndis_wq, &wnd->ndis_work);
@@ -582,15 +595,16 @@ void free_tx_packet(struct ndis_device *wnd, struct ndis_packet *packet,
 }
 
 /* MiniportSend and MiniportSendPackets */
-/* this function is called holding tx_ring_mutex. start and n are such
- * that start + n < TX_RING_SIZE; i.e., packets don't wrap around
- * ring */
-static u8 mp_tx_packets(struct ndis_device *wnd, u8 start, u8 n)
+/* this function is called owning TX_RING_BUSY. start is index
+ * into ring and start + n <= tx_ring_size; i.e., packets don't wrap
+ * around ring */
+static unsigned int mp_tx_packets(struct ndis_device *wnd,
+				  unsigned int start, unsigned int n)
 {
 	NDIS_STATUS res;
 	struct miniport *mp;
 	struct ndis_packet *packet;
-	u8 sent;
+	unsigned int sent;
 	KIRQL irql;
 
 	ENTER3("%d, %d", start, n);
@@ -675,56 +689,108 @@ static u8 mp_tx_packets(struct ndis_device *wnd, u8 start, u8 n)
 	EXIT3(return sent);
 }
 
-static void tx_worker(struct work_struct *work)
+/* send packets in tx_ring to miniport; called owning TX_RING_BUSY */
+static void send_tx_ring(struct ndis_device *wnd)
 {
-	struct ndis_device *wnd;
-	s8 n;
+	unsigned int start, idx, n, i;
 
-	wnd = container_of(work, struct ndis_device, tx_work);
-	ENTER3("tx_ok %d", wnd->tx_ok);
 	while (wnd->tx_ok) {
-		mutex_lock(&wnd->tx_ring_mutex);
-		spin_lock_bh(&wnd->tx_ring_lock);
-		n = wnd->tx_ring_end - wnd->tx_ring_start;
-		TRACE3("%d, %d, %d", wnd->tx_ring_start, wnd->tx_ring_end, n);
-		/* end == start if either ring is empty or full; in
-		 * the latter case is_tx_ring_full is set */
-		if (n == 0) {
-			if (wnd->is_tx_ring_full)
-				n = TX_RING_SIZE - wnd->tx_ring_start;
-			else {
-				spin_unlock_bh(&wnd->tx_ring_lock);
-				mutex_unlock(&wnd->tx_ring_mutex);
-				break;
-			}
-		} else if (n < 0)
-			n = TX_RING_SIZE - wnd->tx_ring_start;
-		spin_unlock_bh(&wnd->tx_ring_lock);
+		start = wnd->tx_ring_start;
+		n = ACCESS_ONCE(wnd->tx_ring_end) - start;
+		TRACE3("%u, %u", start, n);
+		if (n == 0)
+			break;
+		idx = start & (wnd->tx_ring_size - 1);
+		if (n > wnd->tx_ring_size - idx)
+			n = wnd->tx_ring_size - idx;
 		if (unlikely(n > wnd->max_tx_packets))
 			n = wnd->max_tx_packets;
-		n = mp_tx_packets(wnd, wnd->tx_ring_start, n);
-		if (n) {
+		/* a slot may have been reserved, but packet not stored
+		 * in it yet; tx_skbuff queues tx_work again after
+		 * storing packet, so send only packets before it */
+		for (i = 0; i < n; i++)
+			if (!ACCESS_ONCE(wnd->tx_ring[idx + i]))
+				break;
+		if (i == 0)
+			break;
+		smp_rmb();
+		n = mp_tx_packets(wnd, idx, i);
+		if (n == 0)
+			break;
 // trans_start doesn't exist any more beginning with version 4.7.0
 // @see: https://git.kernel.org/pub/scm/linux/kernel/git/torvalds/linux.git/commit/?id=4d659fcb20d3d3302b429c889a73a92ff2804b9a
 #if LINUX_VERSION_CODE < KERNEL_VERSION(4,7,0)
-			wnd->net_dev->trans_start = jiffies;
+		wnd->net_dev->trans_start = jiffies;
 #else
-			netif_trans_update(wnd->net_dev);
+		netif_trans_update(wnd->net_dev);
 #endif
-			wnd->tx_ring_start =
-				(wnd->tx_ring_start + n) % TX_RING_SIZE;
-			wnd->is_tx_ring_full = 0;
-		}
-		mutex_unlock(&wnd->tx_ring_mutex);
-		TRACE3("%d, %d, %d", wnd->tx_ring_start, wnd->tx_ring_end, n);
+		for (i = 0; i < n; i++)
+			wnd->tx_ring[idx + i] = NULL;
+		/* slots must be cleared before they are given back to
+		 * tx_skbuff */
+		smp_mb();
+		wnd->tx_ring_start = start + n;
+		smp_mb();
+		if (wnd->is_tx_ring_full && xchg(&wnd->is_tx_ring_full, 0))
+			netif_wake_queue(wnd->net_dev);
+		TRACE3("%u, %u, %u", wnd->tx_ring_start, wnd->tx_ring_end, n);
 	}
+}
+
+static void tx_worker(struct work_struct *work)
+{
+	struct ndis_device *wnd;
+
+	wnd = container_of(work, struct ndis_device, tx_work);
+	ENTER3("tx_ok %d", wnd->tx_ok);
+	lock_tx_ring(wnd);
+	send_tx_ring(wnd);
+	unlock_tx_ring(wnd);
 	EXIT3(return);
 }
 
+/* undo alloc_tx_packet for packet that couldn't be queued */
+static void release_tx_packet(struct ndis_device *wnd,
+			      struct ndis_packet *packet)
+{
+	if (wnd->sg_dma_size)
+		free_tx_sg_list(wnd, NDIS_PACKET_OOB_DATA(packet));
+	NdisFreeBuffer(packet->private.buffer_head);
+	NdisFreePacket(packet);
+}
+
+static void stop_tx_ring(struct ndis_device *wnd, struct net_device *dev)
+{
+	netif_tx_lock(dev);
+	wnd->is_tx_ring_full = 1;
+	netif_stop_queue(dev);
+	netif_tx_unlock(dev);
+	smp_mb();
+	/* tx_worker may have freed slots before it could see
+	 * is_tx_ring_full */
+	if (ACCESS_ONCE(wnd->tx_ring_end) -
+	    ACCESS_ONCE(wnd->tx_ring_start) < wnd->tx_ring_size &&
+	    xchg(&wnd->is_tx_ring_full, 0))
+		netif_wake_queue(dev);
+}
+
+static inline int tx_skb_more(struct sk_buff *skb)
+{
+#if LINUX_VERSION_CODE >= KERNEL_VERSION(3,18,0)
+	return skb->xmit_more;
+#else
+	return 0;
+#endif
+}
+
+/* net_dev is NETIF_F_LLTX, so this may be called on many CPUs at the
+ * same time; each caller reserves a slot in tx_ring with cmpxchg and
+ * only the owner of TX_RING_BUSY consumes, so no lock is needed */
 static int tx_skbuff(struct sk_buff *skb, struct net_device *dev)
 {
 	struct ndis_device *wnd = netdev_priv(dev);
 	struct ndis_packet *packet;
+	unsigned int end;
 
 	packet = alloc_tx_packet(wnd, skb);
 	if (!packet) {
@@ -732,24 +798,130 @@ static int tx_skbuff(struct sk_buff *skb, struct net_device *dev)
 		netif_tx_lock(dev);
 		netif_stop_queue(dev);
 		netif_tx_unlock(dev);
+		/* packets deferred by tx_direct must still be sent */
+		queue_work(wrapndis_wq, &wnd->tx_work);
 		return NETDEV_TX_BUSY;
 	}
-	spin_lock(&wnd->tx_ring_lock);
-	wnd->tx_ring[wnd->tx_ring_end++] = packet;
-	if (wnd->tx_ring_end == TX_RING_SIZE)
-		wnd->tx_ring_end = 0;
-	if (wnd->tx_ring_end == wnd->tx_ring_start) {
-		netif_tx_lock(dev);
-		wnd->is_tx_ring_full = 1;
-		netif_stop_queue(dev);
-		netif_tx_unlock(dev);
+	do {
+		end = ACCESS_ONCE(wnd->tx_ring_end);
+		if (unlikely(end - ACCESS_ONCE(wnd->tx_ring_start) >=
+			     wnd->tx_ring_size)) {
+			TRACE2("ring full: %u", end);
+			release_tx_packet(wnd, packet);
+			stop_tx_ring(wnd, dev);
+			queue_work(wrapndis_wq, &wnd->tx_work);
+			return NETDEV_TX_BUSY;
+		}
+	} while (cmpxchg(&wnd->tx_ring_end, end, end + 1) != end);
+	/* packet must be set up before tx_worker can see it */
+	smp_wmb();
+	wnd->tx_ring[end & (wnd->tx_ring_size - 1)] = packet;
+	if (end + 1 - ACCESS_ONCE(wnd->tx_ring_start) >= wnd->tx_ring_size)
+		stop_tx_ring(wnd, dev);
+	TRACE4("ring: %u, %u", wnd->tx_ring_start, end + 1);
+	/* deserialized drivers can be called at DISPATCH_LEVEL, so
+	 * if no one else is sending, send here instead of waking up
+	 * tx_worker; more packets in this batch will follow, so
+	 * defer sending until the last one */
+	if (wnd->tx_direct && deserialized_driver(wnd) && wnd->tx_ok) {
+		if (tx_skb_more(skb) && !netif_queue_stopped(dev))
+			return NETDEV_TX_OK;
+		if (!test_and_set_bit(TX_RING_BUSY, &wnd->tx_ring_busy)) {
+			send_tx_ring(wnd);
+			clear_bit(TX_RING_BUSY, &wnd->tx_ring_busy);
+			smp_mb();
+			/* if miniport returned NDIS_STATUS_RESOURCES,
+			 * tx_worker resends when resources are
+			 * available */
+			if (wnd->tx_ring_start == ACCESS_ONCE(wnd->tx_ring_end))
+				return NETDEV_TX_OK;
+		}
 	}
-	spin_unlock(&wnd->tx_ring_lock);
-	TRACE4("ring: %d, %d", wnd->tx_ring_start, wnd->tx_ring_end);
 	queue_work(wrapndis_wq, &wnd->tx_work);
 	return NETDEV_TX_OK;
 }
 
+/* (re)allocate tx_ring with 'size' slots, rounded up to a power of 2,
+ * and size max_tx_packets and transmit pools to it; pending packets
+ * are moved to new ring */
+int set_tx_ring_size(struct ndis_device *wnd, int size)
+{
+	struct ndis_packet **ring, **old_ring;
+	unsigned int n, pending;
+	NDIS_STATUS status;
+
+	if (size < 2)
+		size = 2;
+	else if (size > MAX_TX_RING_SIZE)
+		size = MAX_TX_RING_SIZE;
+	size = roundup_pow_of_two(size);
+	ENTER2("%d, %u", size, wnd->tx_ring_size);
+	if (test_bit(HW_SUSPENDED, &wnd->wd->hw_status) ||
+	    test_bit(HW_HALTED, &wnd->wd->hw_status))
+		EXIT2(return -EBUSY);
+	ring = kzalloc(size * sizeof(*ring), GFP_KERNEL);
+	if (!ring)
+		EXIT2(return -ENOMEM);
+	lock_tx_ring(wnd);
+	old_ring = wnd->tx_ring;
+	pending = 0;
+	if (old_ring) {
+		/* net_dev is NETIF_F_LLTX, so wait for callers
+		 * already in tx_skbuff to finish */
+		netif_tx_disable(wnd->net_dev);
+		synchronize_net();
+		pending = wnd->tx_ring_end - wnd->tx_ring_start;
+		if (pending > size) {
+			unlock_tx_ring(wnd);
+			kfree(ring);
+			if (netif_carrier_ok(wnd->net_dev))
+				netif_wake_queue(wnd->net_dev);
+			EXIT2(return -EBUSY);
+		}
+		for (n = 0; n < pending; n++)
+			ring[n] = old_ring[(wnd->tx_ring_start + n) &
+					   (wnd->tx_ring_size - 1)];
+	}
+	wnd->tx_ring = ring;
+	wnd->tx_ring_size = size;
+	wnd->tx_ring_start = 0;
+	wnd->tx_ring_end = pending;
+	wnd->is_tx_ring_full = (pending == size);
+
+	if (deserialized_driver(wnd)) {
+		/* deserialized drivers don't have a limit, but we
+		 * keep max at tx_ring_size */
+		wnd->max_tx_packets = size;
+	} else {
+		status = mp_query_int(wnd, OID_GEN_MAXIMUM_SEND_PACKETS,
+				      &wnd->max_tx_packets);
+		if (status != NDIS_STATUS_SUCCESS)
+			wnd->max_tx_packets = 1;
+		if (wnd->max_tx_packets > size)
+			wnd->max_tx_packets = size;
+	}
+	TRACE2("maximum send packets: %d", wnd->max_tx_packets);
+	if (wnd->tx_packet_pool) {
+		spin_lock_bh(&wnd->tx_packet_pool->lock);
+		wnd->tx_packet_pool->max_descr = wnd->max_tx_packets;
+		spin_unlock_bh(&wnd->tx_packet_pool->lock);
+	}
+	if (wnd->tx_buffer_pool) {
+		spin_lock_bh(&wnd->tx_buffer_pool->lock);
+		wnd->tx_buffer_pool->max_descr = wnd->max_tx_packets + 4;
+		spin_unlock_bh(&wnd->tx_buffer_pool->lock);
+	}
+	unlock_tx_ring(wnd);
+	if (old_ring) {
+		kfree(old_ring);
+		if (netif_carrier_ok(wnd->net_dev) && !wnd->is_tx_ring_full)
+			netif_wake_queue(wnd->net_dev);
+		if (pending)
+			queue_work(wrapndis_wq, &wnd->tx_work);
+	}
+	EXIT2(return 0);
+}
+
 static int set_packet_filter(struct ndis_device *wnd, ULONG packet_filter)
 {
 	NDIS_STATUS res;
@@ -862,6 +1034,9 @@ static int ndis_net_dev_open(struct net_device *net_dev)
 	if (res == NDIS_STATUS_SUCCESS && status >= NdisMediaStateConnected &&
 	    status <= NdisMediaStateDisconnected)
 		set_media_state(wnd, status);
+#ifdef WRAP_NAPI
+	napi_enable(&wnd->napi);
+#endif
 	netif_start_queue(net_dev);
 	netif_poll_enable(net_dev);
 	EXIT1(return 0);
@@ -869,12 +1044,42 @@ static int ndis_net_dev_open(struct net_device *net_dev)
 
 static int ndis_net_dev_close(struct net_device *net_dev)
 {
-	ENTER1("%p", netdev_priv(net_dev));
+	struct ndis_device *wnd = netdev_priv(net_dev);
+
+	ENTER1("%p", wnd);
 	netif_poll_disable(net_dev);
 	netif_tx_disable(net_dev);
+#ifdef WRAP_NAPI
+	napi_disable(&wnd->napi);
+	skb_queue_purge(&wnd->rx_queue);
+#endif
 	EXIT1(return 0);
 }
 
+#ifdef WRAP_NAPI
+static int ndis_rx_poll(struct napi_struct *napi, int budget)
+{
+	struct ndis_device *wnd = container_of(napi, struct ndis_device, napi);
+	struct sk_buff *skb;
+	int work_done = 0;
+
+	while (work_done < budget &&
+	       (skb = skb_dequeue(&wnd->rx_queue))) {
+		napi_gro_receive(napi, skb);
+		work_done++;
+	}
+	TRACE3("%d, %d", work_done, budget);
+	if (work_done < budget) {
+		napi_complete_done(napi, work_done);
+		/* packets queued before napi_complete wouldn't have
+		 * scheduled napi */
+		if (!skb_queue_empty(&wnd->rx_queue))
+			napi_schedule(napi);
+	}
+	return work_done;
+}
+#endif
+
 static int ndis_change_mtu(struct net_device *net_dev, int mtu)
 {
 	struct ndis_device *wnd = netdev_priv(net_dev);
@@ -1894,6 +2099,13 @@ static NDIS_STATUS ndis_start_device(struct ndis_device *wnd)
 	net_dev->features |= NETIF_F_LLTX;
 #endif
 
+#ifdef WRAP_NAPI
+	netif_napi_add(net_dev, &wnd->napi, ndis_rx_poll, NDIS_NAPI_WEIGHT);
+#endif
+	if (set_tx_ring_size(wnd, tx_ring_size)) {
+		ERROR("couldn't allocate transmit ring");
+		goto err_register;
+	}
 	if (register_netdev(net_dev)) {
 		ERROR("cannot register net device %s", net_dev->name);
 		goto err_register;
@@ -1915,19 +2127,6 @@ static NDIS_STATUS ndis_start_device(struct ndis_device *wnd)
 	       wd->driver->name, n, wnd->drv_ndis_version, buf,
 	       wd->conf_file_name);
 
-	if (deserialized_driver(wnd)) {
-		/* deserialized drivers don't have a limit, but we
-		 * keep max at TX_RING_SIZE */
-		wnd->max_tx_packets = TX_RING_SIZE;
-	} else {
-		status = mp_query_int(wnd, OID_GEN_MAXIMUM_SEND_PACKETS,
-				      &wnd->max_tx_packets);
-		if (status != NDIS_STATUS_SUCCESS)
-			wnd->max_tx_packets = 1;
-		if (wnd->max_tx_packets > TX_RING_SIZE)
-			wnd->max_tx_packets = TX_RING_SIZE;
-	}
-	TRACE2("maximum send packets: %d", wnd->max_tx_packets);
 	NdisAllocatePacketPoolEx(&status, &wnd->tx_packet_pool,
 				 wnd->max_tx_packets, 0,
 				 PROTOCOL_RESERVED_SIZE_IN_PACKET);
@@ -2002,8 +2201,13 @@ buffer_pool_err:
 	}
 packet_pool_err:
 	unregister_netdev(net_dev);
-	wnd->max_tx_packets = 0;
 err_register:
+	/* max_tx_packets is set by set_tx_ring_size, but net_dev is
+	 * not registered */
+	wnd->max_tx_packets = 0;
+	kfree(wnd->tx_ring);
+	wnd->tx_ring = NULL;
+	wnd->tx_ring_size = 0;
 	kfree(buf);
 err_start:
 	mp_halt(wnd);
@@ -2012,7 +2216,6 @@ err_start:
 
 static int ndis_remove_device(struct ndis_device *wnd)
 {
-	s8 tx_pending;
 	int our_mutex;
 
 	/* prevent setting essid during disassociation */
@@ -2024,26 +2227,31 @@ static int ndis_remove_device(struct ndis_device *wnd)
 	/* if device is suspended, but resume failed, tx_ring_mutex
 	 * may already be locked */
 	our_mutex = mutex_trylock(&wnd->tx_ring_mutex);
-	if (!our_mutex)
+	if (our_mutex) {
+		while (test_and_set_bit(TX_RING_BUSY, &wnd->tx_ring_busy))
+			cpu_relax();
+	} else
 		WARNING("couldn't obtain tx_ring_mutex");
-	spin_lock_bh(&wnd->tx_ring_lock);
-	tx_pending = wnd->tx_ring_end - wnd->tx_ring_start;
-	if (tx_pending < 0)
-		tx_pending += TX_RING_SIZE;
-	else if (tx_pending == 0 && wnd->is_tx_ring_full)
-		tx_pending = TX_RING_SIZE - 1;
 	wnd->is_tx_ring_full = 0;
-	/* throw away pending packets */
-	while (tx_pending-- > 0) {
+	/* throw away pending packets; net_dev is unregistered, so
+	 * there are no more producers */
+	while (wnd->tx_ring_start != wnd->tx_ring_end) {
 		struct ndis_packet *packet;
 
-		packet = wnd->tx_ring[wnd->tx_ring_start];
-		free_tx_packet(wnd, packet, NDIS_STATUS_CLOSING);
-		wnd->tx_ring_start = (wnd->tx_ring_start + 1) % TX_RING_SIZE;
+		packet = xchg(&wnd->tx_ring[wnd->tx_ring_start &
+					    (wnd->tx_ring_size - 1)], NULL);
+		if (packet)
+			free_tx_packet(wnd, packet, NDIS_STATUS_CLOSING);
+		wnd->tx_ring_start++;
 	}
-	spin_unlock_bh(&wnd->tx_ring_lock);
+#ifdef WRAP_NAPI
+	skb_queue_purge(&wnd->rx_queue);
+#endif
+	kfree(wnd->tx_ring);
+	wnd->tx_ring = NULL;
+	wnd->tx_ring_size = 0;
 	if (our_mutex)
-		mutex_unlock(&wnd->tx_ring_mutex);
+		unlock_tx_ring(wnd);
 	mp_halt(wnd);
 	ndis_exit_device(wnd);
 
@@ -2126,14 +2334,20 @@ static NTSTATUS ndis_add_device(struct driver_object *drv_obj,
 		EXIT1(return STATUS_RESOURCES);
 	}
 	nmb->next_device = IoAttachDeviceToDeviceStack(fdo, pdo);
-	spin_lock_init(&wnd->tx_ring_lock);
 	mutex_init(&wnd->tx_ring_mutex);
+	wnd->tx_ring_busy = 0;
+	wnd->tx_direct = tx_direct ? 1 : 0;
 	mutex_init(&wnd->ndis_req_mutex);
 	wnd->ndis_req_done = 0;
 	INIT_WORK(&wnd->tx_work, tx_worker);
+#ifdef WRAP_NAPI
+	skb_queue_head_init(&wnd->rx_queue);
+#endif
 	wnd->tx_ring_start = 0;
 	wnd->tx_ring_end = 0;
 	wnd->is_tx_ring_full = 0;
+	wnd->tx_ring = NULL;
+	wnd->tx_ring_size = 0;
 	wnd->capa.encr = 0;
 	wnd->capa.auth = 0;
 	wnd->attributes = 0;
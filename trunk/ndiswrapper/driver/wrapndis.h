@@ -77,6 +77,8 @@ void free_tx_packet(struct ndis_device *wnd, struct ndis_packet *packet,
 int init_ndis_driver(struct driver_object *drv_obj);
 NDIS_STATUS ndis_reinit(struct ndis_device *wnd);
 void set_media_state(struct ndis_device *wnd, enum ndis_media_state state);
+int set_tx_ring_size(struct ndis_device *wnd, int size);
+void set_timer_slack(struct ndis_device *wnd, unsigned long slack);
 
 void hangcheck_add(struct ndis_device *wnd);
 void hangcheck_del(struct ndis_device *wnd);
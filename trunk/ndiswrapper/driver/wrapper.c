@@ -22,6 +22,10 @@
 char *if_name = "wlan%d";
 int proc_uid, proc_gid;
 int hangcheck_interval;
+int tx_ring_size = TX_RING_SIZE;
+int tx_direct;
+int dpc_tasklet;
+int usb_complete_direct;
 static char *utils_version = UTILS_VERSION;
 int debug = DEBUG;
 
@@ -45,6 +49,27 @@ module_param(hangcheck_interval, int, 0600);
 MODULE_PARM_DESC(hangcheck_interval, "The interval, in seconds, for checking"
 		 " if driver is hung. (default: 0)");
 
+module_param(tx_ring_size, int, 0600);
+MODULE_PARM_DESC(tx_ring_size, "Number of packets in transmit ring of "
+		 "new devices; rounded up to a power of 2, at most 1024 "
+		 "(default: 16)");
+
+module_param(tx_direct, int, 0600);
+MODULE_PARM_DESC(tx_direct, "If set, deserialized drivers are called "
+		 "directly when transmitting, instead of from a worker thread "
+		 "(default: 0)");
+
+module_param(dpc_tasklet, int, 0400);
+MODULE_PARM_DESC(dpc_tasklet, "If set, DPCs are run from tasklets instead "
+		 "of worker threads; drivers that sleep or check IRQL in DPCs "
+		 "may need this to be 0 (default: 0)");
+
+module_param(usb_complete_direct, int, 0600);
+MODULE_PARM_DESC(usb_complete_direct, "If set, IRPs for USB transfers are "
+		 "completed directly when URBs complete, unless that is in hard "
+		 "interrupt context; drivers that sleep or check IRQL in "
+		 "completion routines may need this to be 0 (default: 0)");
+
 module_param(utils_version, charp, 0400);
 MODULE_PARM_DESC(utils_version, "Compatible version of utils "
 		 "(read only: " UTILS_VERSION ")");
@@ -20,5 +20,9 @@ extern char *if_name;
 extern int proc_uid;
 extern int proc_gid;
 extern int hangcheck_interval;
+extern int tx_ring_size;
+extern int tx_direct;
+extern int dpc_tasklet;
+extern int usb_complete_direct;
 
 #endif /* WRAPPER_H */